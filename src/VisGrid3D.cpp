@@ -4,22 +4,23 @@
 #include <algorithm>
 #include "cxxopts.hpp"
 #include <fstream>
+#include <sstream>
 #include <boost/program_options.hpp>
 #include "visualizer.h"
 #include "colormap.h"
+#include "container.h"
 #include <boost/filesystem.hpp>
 
-// TODO: Add support for generating movies
 
 
-std::vector<std::string> SplitString(std::string s) {
+std::vector<std::string> SplitString(std::string s, char sep = ',') {
   unsigned long idx_prev = 0;
-  unsigned long idx = s.find(",", idx_prev);
+  unsigned long idx = s.find(sep, idx_prev);
   std::vector<std::string> v;
   while (idx != std::string::npos) {
     v.push_back(s.substr(idx_prev, idx - idx_prev));
     idx_prev = idx + 1;
-    idx = (int) s.find(",", idx_prev);
+    idx = (int) s.find(sep, idx_prev);
   }
   v.push_back(s.substr(idx_prev, s.size() - idx_prev));
   return v;
@@ -38,6 +39,11 @@ cxxopts::Options GetPars(int argc, char *argv[]) {
       ("a,alpha", "Comma-separated list of alpha-values associated to the cell types", cxxopts::value<std::string>())
       ("static", "Comma-separated list of static cell types", cxxopts::value<std::string>())
       ("steps", "Comma-separated list of time steps to visualize", cxxopts::value<std::string>())
+      ("first", "Leave out the steps before this one", cxxopts::value<int>())
+      ("last", "Leave out the steps after this one", cxxopts::value<int>())
+      ("stride", "Visualize every n-th of the selected steps", cxxopts::value<int>()->default_value("1"))
+      ("shard", "Visualize only part i/n (i from 0 to n-1) of the selected steps, to spread them over n processes "
+       "writing to the same outdir (a --movie gets _iofn added to its name)", cxxopts::value<std::string>())
       ("W,width", "visualization width", cxxopts::value<int>()->default_value("800"))
       ("H,height", "visualization height", cxxopts::value<int>()->default_value("800"))
       ("bgcolor", "background color", cxxopts::value<std::string>()->default_value("black"))
@@ -47,10 +53,20 @@ cxxopts::Options GetPars(int argc, char *argv[]) {
       ("campitch", "camera pitch", cxxopts::value<double>())
       ("camroll", "camera roll", cxxopts::value<double>())
       ("camazimuth", "camera aximuth", cxxopts::value<double>())
-      ("fps", "frame rate", cxxopts::value<int>())
+      ("views", "File with a camera view per line to render every step from off screen, as name followed by any of "
+       "campos=x,y,z camfocus=x,y,z campitch=a camroll=a camazimuth=a (the camera options are the defaults); images "
+       "are named prefix_name_step", cxxopts::value<std::string>())
+      ("fps", "frame rate", cxxopts::value<double>())
       ("o,outdir", "Folder to write images to", cxxopts::value<std::string>())
       ("s,save", "Save images", cxxopts::value<bool>())
       ("prefix", "Prefix for image names", cxxopts::value<std::string>())
+      ("format", "Image format: png, ppm or raw (rgb bytes, top row first)",
+       cxxopts::value<std::string>()->default_value("png"))
+      ("pnglevel", "zlib compression level of png images (0-9), lower is faster",
+       cxxopts::value<int>()->default_value("5"))
+      ("encoders", "Number of threads writing images", cxxopts::value<int>()->default_value("2"))
+      ("movie", "Stream the frames into this movie with ffmpeg instead of writing images, in the format that goes "
+       "with its extension (e.g. run.mp4), at --fps frames per second", cxxopts::value<std::string>())
       ("m,colormap","File with colormap to be used with the fields", cxxopts::value<std::string>())
       ("fmax","Comma-seperated list with max value for each field", cxxopts::value<std::string>())
       ("fmin","Comma-seperated list with min value for each field", cxxopts::value<std::string>())
@@ -65,6 +81,38 @@ cxxopts::Options GetPars(int argc, char *argv[]) {
       ("q,quiet","Hide visualization windows", cxxopts::value<bool>())
       ("clean","Remove existing content of outdir", cxxopts::value<bool>())
       ("z,gzip","Use gzipped vtk files", cxxopts::value<bool>())
+      ("threads","Number of threads used to extract the geometry (default: all cores)", cxxopts::value<int>())
+      ("readmode","How to read the vtk files: native, singlepass or multipass",
+       cxxopts::value<std::string>()->default_value("native"))
+      ("timing","Report the time spent reading each step", cxxopts::value<bool>())
+      ("prefetch","Number of upcoming steps to read in the background", cxxopts::value<int>()->default_value("0"))
+      ("prefetchmb","Maximum memory (in MB) used by prefetched steps",
+       cxxopts::value<int>()->default_value("2048"))
+      ("convert","Convert the vtk files to a binary container (.vg3d) that can be used as simdir, and exit",
+       cxxopts::value<std::string>())
+      ("compress","zlib compression level (0-9) used by convert, 0 stores the fields raw so they are memory-mapped "
+       "without copying", cxxopts::value<int>()->default_value("6"))
+      ("cachemb","Memory (in MB) used to keep steps for revisiting them, 0 to disable",
+       cxxopts::value<int>()->default_value("0"))
+      ("render","How to draw the cells: glyph (a cube per voxel), faces (only the faces on the boundary of each "
+       "type), surface (smoothed surfaces) or volume (ray cast on the CPU, with --alpha as opacity)",
+       cxxopts::value<std::string>()->default_value("glyph"))
+      ("greedy","Merge the faces drawn with --render faces into as few rectangles as possible", cxxopts::value<bool>())
+      ("surfaceby","Draw a surface per type or per cell with --render surface (surfaces colored by a field are "
+       "always drawn per cell)", cxxopts::value<std::string>()->default_value("type"))
+      ("smooth","Number of smoothing iterations for surfaces, 0 to disable", cxxopts::value<int>()->default_value("20"))
+      ("decimate","Fraction (0-1) of the triangles of surfaces to remove", cxxopts::value<double>()->default_value("0"))
+      ("incremental","Only rebuild the bricks that changed since the previous step (not with --render surface or "
+       "volume)",
+       cxxopts::value<bool>())
+      ("bricksize","Draw the grid in bricks with this many voxels along each side, 0 to draw each type as a whole "
+       "(default: 0, or 32 with --incremental)", cxxopts::value<int>())
+      ("lod","Factor to downsample the grid by while playing or moving the camera on screen, 1 for full detail "
+       "(space pauses and shows full detail)", cxxopts::value<int>()->default_value("1"))
+      ("nocull","Also draw glyphs for voxels that are enclosed by voxels of the same opaque type",
+       cxxopts::value<bool>())
+      ("backend","Draw with vtk, or with raycast: a built-in ray caster that draws voxels without OpenGL (only with "
+       "-q, without --render, boundary planes and bounding box)", cxxopts::value<std::string>()->default_value("vtk"))
       ;
 
 
@@ -104,6 +152,63 @@ color GetColorFromString(std::string s, ColorTable * ct){
     return ct->GetRGBDouble(v[0]);
 }
 
+// read camera views as lines with a name and settings such as campos=0,0,100, starting from the camera in vis
+std::vector<cameraview> ReadViews(std::string fn, Visualizer *vis) {
+  std::ifstream file(fn);
+  if (!file) {
+    std::cout << "Could not open " << fn << std::endl;
+    exit(0);
+  }
+  std::vector<cameraview> views;
+  std::string line;
+  while (std::getline(file, line)) {
+    std::stringstream ss(line);
+    cameraview view;
+    if (!(ss >> view.name) || view.name[0] == '#')
+      continue;
+    // the position and focus are only known when both are given, here or on the command line
+    bool position = vis->camplaced, focus = vis->camplaced;
+    for (int i = 0; i < 3; i++) {
+      view.position[i] = vis->camplaced ? vis->camposition[i] : 0;
+      view.focus[i] = vis->camplaced ? vis->camfocus[i] : 0;
+    }
+    view.pitch = vis->campitch;
+    view.roll = vis->camroll;
+    view.azimuth = vis->camazimuth;
+    std::string setting;
+    while (ss >> setting) {
+      size_t eq = setting.find('=');
+      std::string key = setting.substr(0, eq);
+      std::vector<std::string> v = SplitString((eq == std::string::npos) ? "" : setting.substr(eq + 1));
+      if ((key.compare("campos") == 0 || key.compare("camfocus") == 0) && v.size() == 3) {
+        for (int i = 0; i < 3; i++) { (key.compare("campos") == 0 ? view.position : view.focus)[i] = stod(v[i]); }
+        (key.compare("campos") == 0 ? position : focus) = true;
+      } else if (key.compare("campitch") == 0 && v.size() == 1) {
+        view.pitch = stod(v[0]);
+      } else if (key.compare("camroll") == 0 && v.size() == 1) {
+        view.roll = stod(v[0]);
+      } else if (key.compare("camazimuth") == 0 && v.size() == 1) {
+        view.azimuth = stod(v[0]);
+      } else {
+        std::cout << "Unknown camera setting " << setting << " for view " << view.name << std::endl;
+        exit(0);
+      }
+    }
+    if (position != focus) {
+      std::cout << "View " << view.name << " needs both campos and camfocus, or neither to turn the camera fitted "
+                << "to the grid" << std::endl;
+      exit(0);
+    }
+    view.custom = position && focus;
+    views.push_back(view);
+  }
+  if (views.empty()) {
+    std::cout << "No views found in " << fn << std::endl;
+    exit(0);
+  }
+  return views;
+}
+
 int main(int argc, char *argv[]) {
   std::vector<int> steps;
   std::vector<double> alpha;
@@ -120,7 +225,11 @@ int main(int argc, char *argv[]) {
 
   // Set up data reader
   std::string datapath;
-  if (opt.count("simdir")) { datapath = FixPath(opt["simdir"].as<std::string>()); }
+  if (opt.count("simdir")) {
+    datapath = opt["simdir"].as<std::string>();
+    if (!IsContainer(datapath))
+      datapath = FixPath(datapath);
+  }
   else { datapath = "./"; }
   std::vector<std::string> color_by;
   std::vector<std::string> extra_fields;
@@ -131,6 +240,18 @@ int main(int argc, char *argv[]) {
     extra_fields.resize(std::distance(extra_fields.begin(), it));
   }
   DataReader *dr = new DataReader("plot", datapath, extra_fields, opt.count("gzip") > 0);
+  std::string readmode = opt["readmode"].as<std::string>();
+  if (readmode.compare("native") == 0)
+    dr->readmode = READ_NATIVE;
+  else if (readmode.compare("multipass") == 0)
+    dr->readmode = READ_MULTIPASS;
+  else if (readmode.compare("singlepass") == 0)
+    dr->readmode = READ_SINGLEPASS;
+  else {
+    std::cout << "Unknown read mode " << readmode << std::endl;
+    exit(0);
+  }
+  if (opt.count("timing")) { dr->timing = true; }
   // select step to visualize
   if (opt.count("steps")) {
     for (auto s : SplitString(opt["steps"].as<std::string>()))
@@ -139,6 +260,61 @@ int main(int argc, char *argv[]) {
     steps = dr->FindSteps();
     std::cout << "Steps not specified - Visualize for all " << steps.size() << " vtk files" << std::endl;
   }
+  std::vector<int> selected;
+  for (auto s : steps) {
+    bool after = opt.count("first") == 0 || s >= opt["first"].as<int>();
+    bool before = opt.count("last") == 0 || s <= opt["last"].as<int>();
+    if (after && before)
+      selected.push_back(s);
+  }
+  steps.clear();
+  for (size_t i = 0; i < selected.size(); i += std::max(opt["stride"].as<int>(), 1)) { steps.push_back(selected[i]); }
+  if (steps.empty()) {
+    std::cout << "No steps left to visualize" << std::endl;
+    exit(0);
+  }
+  // image names are as long in every shard
+  int maxstep = *std::max_element(steps.begin(), steps.end());
+  bool sharded = opt.count("shard") > 0;
+  int shard = 0, nshards = 1;
+  if (sharded) {
+    std::vector<std::string> v = SplitString(opt["shard"].as<std::string>(), '/');
+    shard = (v.size() == 2) ? stoi(v[0]) : -1;
+    nshards = (v.size() == 2) ? stoi(v[1]) : 0;
+    if (shard < 0 || shard >= nshards) {
+      std::cout << "Shard should be given as i/n with 0 <= i < n" << std::endl;
+      exit(0);
+    }
+    // contiguous blocks, so the steps of a shard follow each other as they do without sharding
+    size_t begin = steps.size() * shard / nshards, end = steps.size() * (shard + 1) / nshards;
+    steps = std::vector<int>(steps.begin() + begin, steps.begin() + end);
+    if (steps.empty()) {
+      std::cout << "Shard " << shard << "/" << nshards << " has no steps to visualize" << std::endl;
+      exit(0);
+    }
+    std::cout << "Shard " << shard << "/" << nshards << " visualizes steps " << steps.front() << " to "
+              << steps.back() << std::endl;
+  }
+  std::vector<std::string> all_fields;
+  if (opt.count("convert")) {
+    // store every field, so the container can be used with any coloring
+    all_fields = dr->FindFields(steps[0]);
+    std::vector<std::string> f;
+    for (auto name : all_fields) {
+      if (name.compare("cell.id") != 0 && name.compare("cell.type") != 0)
+        f.push_back(name);
+    }
+    dr->SetExtraFields(f);
+  }
+  if (opt["cachemb"].as<int>() > 0)
+    dr->EnableCache((size_t) opt["cachemb"].as<int>() << 20);
+  if (opt["prefetch"].as<int>() > 0)
+    dr->EnablePrefetch(steps, opt["prefetch"].as<int>(), (size_t) opt["prefetchmb"].as<int>() << 20);
+  if (opt.count("convert")) {
+    WriteContainer(opt["convert"].as<std::string>(), dr, steps, all_fields, opt["compress"].as<int>());
+    delete dr;
+    exit(0);
+  }
 
   // Select types to plot and update
   std::vector<int> types;
@@ -210,12 +386,59 @@ int main(int argc, char *argv[]) {
   if (opt.count("bgcolor")){ vis->bgcolor = GetColorFromString(opt["bgcolor"].as<std::string>(),ct); }
   if (opt.count("bboxcolor")) { vis->bbcolor = GetColorFromString(opt["bboxcolor"].as<std::string>(),ct); }
   if (opt.count("fps")) { vis->fps = opt["fps"].as<double>(); }
+  if (opt.count("threads")) { vis->nthreads = opt["threads"].as<int>(); }
+  vis->render = opt["render"].as<std::string>();
+  if (vis->render.compare("glyph") != 0 && vis->render.compare("faces") != 0 && vis->render.compare("surface") != 0
+      && vis->render.compare("volume") != 0) {
+    std::cout << "Unknown render mode " << vis->render << std::endl;
+    exit(0);
+  }
+  if (opt.count("greedy")) { vis->greedy = true; }
+  vis->surfaceby = opt["surfaceby"].as<std::string>();
+  if (vis->surfaceby.compare("type") != 0 && vis->surfaceby.compare("cell") != 0) {
+    std::cout << "Unknown surface mode " << vis->surfaceby << std::endl;
+    exit(0);
+  }
+  if (opt.count("nocull")) { vis->cull = false; }
+  vis->lod = std::max(opt["lod"].as<int>(), 1);
+  if (opt.count("bricksize")) { vis->bricksize = std::max(opt["bricksize"].as<int>(), 0); }
+  if (opt.count("incremental")) {
+    vis->incremental = true;
+    if (!opt.count("bricksize")) { vis->bricksize = 32; }
+  }
+  bool whole = vis->render.compare("surface") == 0 || vis->render.compare("volume") == 0;
+  if (whole && (vis->incremental || vis->bricksize > 0)) {
+    std::cout << "Bricks are not available for surfaces and volumes, drawing each type as a whole" << std::endl;
+    vis->incremental = false;
+    vis->bricksize = 0;
+  }
+  if (vis->incremental && vis->bricksize == 0) {
+    std::cout << "Incremental updates need bricks, using bricks of 32 voxels" << std::endl;
+    vis->bricksize = 32;
+  }
+  vis->smooth = opt["smooth"].as<int>();
+  vis->decimate = opt["decimate"].as<double>();
+  if (vis->decimate < 0 || vis->decimate >= 1) {
+    std::cout << "Decimation should be at least 0 and less than 1" << std::endl;
+    exit(0);
+  }
   bool onscreen = true;
   if (opt.count("quiet")){ onscreen = false;}
+  vis->backend = opt["backend"].as<std::string>();
+  if (vis->backend.compare("vtk") != 0 && vis->backend.compare("raycast") != 0) {
+    std::cout << "Unknown backend " << vis->backend << std::endl;
+    exit(0);
+  }
+  bool raycast = vis->backend.compare("raycast") == 0;
+  if (raycast && onscreen) {
+    std::cout << "The raycast backend only draws off screen, use -q" << std::endl;
+    exit(0);
+  }
   vis->InitRenderer(onscreen);
 
 //   set up camera
   bool modcam = false;
+  bool posset = false, focusset = false;
   if (opt.count("campos")) {
     modcam = true;
     std::vector<std::string> v = SplitString(opt["campos"].as<std::string>());
@@ -223,6 +446,7 @@ int main(int argc, char *argv[]) {
       for (int i = 0; i < 3; i++) {
         vis->camposition[i] = stoi(v[i]);
       }
+      posset = true;
     }
   }
   if (opt.count("camfocus")) {
@@ -232,6 +456,7 @@ int main(int argc, char *argv[]) {
       for (int i = 0; i < 3; i++) {
         vis->camfocus[i] = stoi(v[i]);
       }
+      focusset = true;
     }
   }
   if (opt.count("campitch")) {
@@ -246,21 +471,41 @@ int main(int argc, char *argv[]) {
     modcam = true;
     vis->camazimuth = opt["camazimuth"].as<double>();
   }
+  vis->camplaced = posset && focusset;
   if (modcam) { vis->ModifyCamera(); }
+  if (opt.count("views")) {
+    if (onscreen) {
+      std::cout << "Views are only rendered off screen, use -q" << std::endl;
+      exit(0);
+    }
+    vis->views = ReadViews(opt["views"].as<std::string>(), vis);
+  }
 
   // set saving options
   bool save = false;
-  if (opt.count("save") | opt.count("outdir")) { save = true; }
+  if (opt.count("save") | opt.count("outdir") | opt.count("movie")) { save = true; }
+  if (opt.count("movie")) { vis->movie = opt["movie"].as<std::string>(); }
+  // every shard writes its own movie, named like run_3of50.mp4
+  if (sharded) { vis->movietag = "_" + std::to_string(shard) + "of" + std::to_string(nshards); }
   if (opt.count("outdir")) {
     std::string outdir = FixPath(opt["outdir"].as<std::string>());
-    if (opt.count("clean"))
+    if (opt.count("clean") && sharded)
+      std::cout << "Not cleaning " << outdir << ", other shards may be writing to it" << std::endl;
+    if (opt.count("clean") && !sharded)
       SetOutputDirectory(outdir,true);
     else
       SetOutputDirectory(outdir,false);
     vis->impath = outdir;
   }
   if (opt.count("prefix")) { vis->prefix = opt["prefix"].as<std::string>(); }
-  if (save) { vis->numlen = (int)std::to_string(steps[steps.size() - 1]).size(); }
+  vis->format = opt["format"].as<std::string>();
+  if (vis->format.compare("png") != 0 && vis->format.compare("ppm") != 0 && vis->format.compare("raw") != 0) {
+    std::cout << "Unknown image format " << vis->format << std::endl;
+    exit(0);
+  }
+  vis->pnglevel = std::min(std::max(opt["pnglevel"].as<int>(), 0), 9);
+  vis->encoders = std::max(opt["encoders"].as<int>(), 1);
+  if (save) { vis->numlen = (int)std::to_string(maxstep).size(); }
 
   // set looping
   bool loop = false;
@@ -276,7 +521,7 @@ int main(int argc, char *argv[]) {
   if (opt.count("zmax")){planes["zmax"] = GetColorFromString(opt["zmax"].as<std::string>(),ct);}
 
     // run animation
-  if (steps.size() > 1) {
+  if (steps.size() > 1 || raycast || !vis->views.empty()) {
     if (onscreen)
       vis->AnimateOnScreen(types, steps, stattypes, colors, alpha, save, color_by, cms, loop, planes);
     else {
@@ -285,8 +530,10 @@ int main(int argc, char *argv[]) {
     }
   }
   else
-    vis->VisualizeStep(steps[0], types, onscreen, colors, alpha, save, color_by, cms, planes, true);
-
+    vis->VisualizeStep(steps[0], types, onscreen, colors, alpha, save, color_by, cms, planes, true, false);
 
+  delete vis;
+  dr->PrintCacheStats();
+  delete dr;
   return EXIT_SUCCESS;
 }
\ No newline at end of file
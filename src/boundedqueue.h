@@ -0,0 +1,52 @@
+//
+// Blocking queue with a fixed capacity to hand work between the stages of a pipeline
+//
+
+#ifndef VISGRID3D_BOUNDEDQUEUE_H
+#define VISGRID3D_BOUNDEDQUEUE_H
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+template<class T>
+class BoundedQueue {
+ public:
+  BoundedQueue(size_t _capacity) : capacity(std::max<size_t>(_capacity, 1)), closed(false) {}
+  // Add an item, waiting while the queue is full
+  void Push(T item) {
+    std::unique_lock<std::mutex> lock(mutex);
+    notfull.wait(lock, [&] { return items.size() < capacity || closed; });
+    items.push_back(item);
+    notempty.notify_one();
+  }
+  // Take the oldest item, waiting while the queue is empty; returns false once it is closed and empty
+  bool Pop(T &item) {
+    std::unique_lock<std::mutex> lock(mutex);
+    notempty.wait(lock, [&] { return !items.empty() || closed; });
+    if (items.empty())
+      return false;
+    item = items.front();
+    items.pop_front();
+    notfull.notify_one();
+    return true;
+  }
+  // Tell the consumers that no more items will come
+  void Close() {
+    std::lock_guard<std::mutex> lock(mutex);
+    closed = true;
+    notempty.notify_all();
+    notfull.notify_all();
+  }
+
+ private:
+  size_t capacity;
+  bool closed;
+  std::deque<T> items;
+  std::mutex mutex;
+  std::condition_variable notfull;
+  std::condition_variable notempty;
+};
+
+#endif //VISGRID3D_BOUNDEDQUEUE_H
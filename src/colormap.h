@@ -53,15 +53,27 @@ public:
   };
 
   color GetColor(int val, int vmin, int vmax){
+    return colormap[GetIndex(val, vmin, vmax)];
+  }
+
+  // Position in the colormap of a value, as used by GetColor
+  int GetIndex(int val, int vmin, int vmax) const {
     if (gmax == -1) {
       if (vmin == vmax)
-        return colormap[0];
+        return 0;
       else
-        return colormap[(int) round(255 * (val - vmin) / (vmax - vmin))];
+        return (int) round(255 * (val - vmin) / (vmax - vmin));
     }
     else
-      return colormap[(int)round(255*(val-gmin)/(gmax-gmin))];
+      return (int)round(255*(val-gmin)/(gmax-gmin));
+  }
 
+  // Color at a position in the colormap without adding missing positions (which are black)
+  color GetColorForIndex(int idx) const {
+    std::map<int,color>::const_iterator it = colormap.find(idx);
+    if (it == colormap.end())
+      return {0, 0, 0};
+    return it->second;
   }
 
   int gmin, gmax;
@@ -7,6 +7,8 @@
 
 #include <string>
 #include <fstream>
+#include <iostream>
+#include <map>
 
 struct color { double r, g, b; };
 
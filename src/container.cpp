@@ -0,0 +1,286 @@
+//
+// Binary container for time series converted from vtk files
+//
+// Layout (native byte order):
+//   char[4]   "VG3D"
+//   uint32    version
+//   int32[3]  dimensions
+//   double[3] origin
+//   double[3] spacing
+//   uint32    number of fields, followed per field by
+//               uint32 name length, name, int32 vtk data type, int32 number of components
+//   uint32    number of steps, followed per step by
+//               int32 step, and per field uint64 offset, uint64 stored size, uint64 raw size, uint32 codec
+//   the data of each field of each step, compressed separately or stored raw at 64 byte aligned offsets
+//
+
+#include "container.h"
+
+#include <iostream>
+#include <fstream>
+#include <cstring>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include <vtkPointData.h>
+#include <vtkDataArray.h>
+
+namespace {
+
+const char magic[4] = {'V', 'G', '3', 'D'};
+const uint32_t version = 1;
+const uint32_t CODEC_RAW = 0;
+const uint32_t CODEC_ZLIB = 1;
+const std::streamoff ALIGNMENT = 64;
+
+template<class T>
+void Write(std::ofstream &out, T value) {
+  out.write((const char *) &value, sizeof(T));
+}
+
+template<class T>
+T Read(std::ifstream &in) {
+  T value;
+  in.read((char *) &value, sizeof(T));
+  return value;
+}
+
+vtkSmartPointer<vtkDataArray> GetArray(const stepdata &sd, std::string name) {
+  if (name == "cell.id")
+    return sd.sigma;
+  if (name == "cell.type")
+    return sd.tau;
+  std::map<std::string, vtkSmartPointer<vtkDataArray> >::const_iterator it = sd.extra_fields.find(name);
+  return (it == sd.extra_fields.end()) ? NULL : it->second;
+}
+
+void AddArray(vtkSmartPointer<vtkStructuredPoints> sp, vtkSmartPointer<vtkDataArray> array) {
+  if (sp->GetPointData()->GetScalars() == NULL)
+    sp->GetPointData()->SetScalars(array);
+  else
+    sp->GetPointData()->AddArray(array);
+}
+
+}
+
+
+void WriteContainer(std::string fn, DataReader *reader, std::vector<int> steps, std::vector<std::string> fields,
+                    int level) {
+  uint32_t codec = (level == 0) ? CODEC_RAW : CODEC_ZLIB;
+  std::ofstream out(fn, std::ios_base::out | std::ios_base::binary | std::ios_base::trunc);
+  if (!out) {
+    std::cout << "Could not open " << fn << " for writing" << std::endl;
+    exit(0);
+  }
+  stepdata_ptr first = reader->GetDataForStep(steps[0]);
+  int *dim = first->sp->GetDimensions();
+  double *origin = first->sp->GetOrigin();
+  double *spacing = first->sp->GetSpacing();
+  int32_t dims[3] = {dim[0], dim[1], dim[2]};
+
+  out.write(magic, 4);
+  Write<uint32_t>(out, version);
+  for (int i = 0; i < 3; i++) { Write<int32_t>(out, dims[i]); }
+  for (int i = 0; i < 3; i++) { Write<double>(out, origin[i]); }
+  for (int i = 0; i < 3; i++) { Write<double>(out, spacing[i]); }
+  Write<uint32_t>(out, (uint32_t) fields.size());
+  for (auto f : fields) {
+    vtkSmartPointer<vtkDataArray> a = GetArray(*first, f);
+    if (a == NULL) {
+      std::cout << "Could not find array " << f << std::endl;
+      exit(0);
+    }
+    Write<uint32_t>(out, (uint32_t) f.size());
+    out.write(f.c_str(), f.size());
+    Write<int32_t>(out, a->GetDataType());
+    Write<int32_t>(out, a->GetNumberOfComponents());
+  }
+  Write<uint32_t>(out, (uint32_t) steps.size());
+  // reserve space for the index, it is filled in once all steps are written
+  std::streampos index_pos = out.tellp();
+  size_t entry_size = sizeof(int32_t) + fields.size() * (3 * sizeof(uint64_t) + sizeof(uint32_t));
+  std::vector<char> zeros(steps.size() * entry_size, 0);
+  out.write(zeros.data(), zeros.size());
+  first.reset();
+
+  std::vector<std::vector<uint64_t> > offsets(steps.size()), sizes(steps.size()), rawsizes(steps.size());
+  std::vector<Bytef> zbuf;
+  for (size_t s = 0; s < steps.size(); s++) {
+    stepdata_ptr sd = reader->GetDataForStep(steps[s]);
+    int *d = sd->sp->GetDimensions();
+    if (d[0] != dims[0] || d[1] != dims[1] || d[2] != dims[2]) {
+      std::cout << "Dimensions of step " << steps[s] << " differ from those of step " << steps[0] << std::endl;
+      exit(0);
+    }
+    for (auto f : fields) {
+      vtkSmartPointer<vtkDataArray> a = GetArray(*sd, f);
+      uLong rawsize = (uLong) (a->GetNumberOfTuples() * a->GetNumberOfComponents() * a->GetDataTypeSize());
+      if (codec == CODEC_RAW) {
+        // keep raw columns aligned so they can be used in place from a memory map
+        std::streamoff pad = (ALIGNMENT - out.tellp() % ALIGNMENT) % ALIGNMENT;
+        out.write(std::string(pad, '\0').c_str(), pad);
+        offsets[s].push_back((uint64_t) out.tellp());
+        sizes[s].push_back(rawsize);
+        rawsizes[s].push_back(rawsize);
+        out.write((const char *) a->GetVoidPointer(0), rawsize);
+        continue;
+      }
+      uLongf zsize = compressBound(rawsize);
+      if (zbuf.size() < zsize) { zbuf.resize(zsize); }
+      if (compress2(zbuf.data(), &zsize, (const Bytef *) a->GetVoidPointer(0), rawsize, level) != Z_OK) {
+        std::cout << "Could not compress " << f << " of step " << steps[s] << std::endl;
+        exit(0);
+      }
+      offsets[s].push_back((uint64_t) out.tellp());
+      sizes[s].push_back(zsize);
+      rawsizes[s].push_back(rawsize);
+      out.write((const char *) zbuf.data(), zsize);
+    }
+    std::cout << "Converted step " << steps[s] << std::endl;
+  }
+
+  out.seekp(index_pos);
+  for (size_t s = 0; s < steps.size(); s++) {
+    Write<int32_t>(out, steps[s]);
+    for (size_t f = 0; f < fields.size(); f++) {
+      Write<uint64_t>(out, offsets[s][f]);
+      Write<uint64_t>(out, sizes[s][f]);
+      Write<uint64_t>(out, rawsizes[s][f]);
+      Write<uint32_t>(out, codec);
+    }
+  }
+  out.close();
+  if (!out) {
+    std::cout << "Could not write " << fn << std::endl;
+    exit(0);
+  }
+  std::cout << "Wrote " << steps.size() << " steps to " << fn << std::endl;
+}
+
+
+ContainerReader::ContainerReader(std::string _fn) {
+  fn = _fn;
+  std::ifstream in(fn, std::ios_base::in | std::ios_base::binary);
+  char m[4];
+  in.read(m, 4);
+  if (!in || memcmp(m, magic, 4) != 0 || Read<uint32_t>(in) != version) {
+    std::cout << fn << " is not a VisGrid3D container" << std::endl;
+    exit(0);
+  }
+  for (int i = 0; i < 3; i++) { dim[i] = Read<int32_t>(in); }
+  for (int i = 0; i < 3; i++) { origin[i] = Read<double>(in); }
+  for (int i = 0; i < 3; i++) { spacing[i] = Read<double>(in); }
+  uint32_t nfields = Read<uint32_t>(in);
+  for (uint32_t i = 0; i < nfields && in; i++) {
+    field f;
+    f.name.resize(Read<uint32_t>(in));
+    in.read(&f.name[0], f.name.size());
+    f.type = Read<int32_t>(in);
+    f.ncomp = Read<int32_t>(in);
+    fields.push_back(f);
+  }
+  uint32_t nsteps = Read<uint32_t>(in);
+  for (uint32_t i = 0; i < nsteps && in; i++) {
+    int step = Read<int32_t>(in);
+    std::vector<column> columns(nfields);
+    for (auto &c : columns) {
+      c.offset = Read<uint64_t>(in);
+      c.size = Read<uint64_t>(in);
+      c.rawsize = Read<uint64_t>(in);
+      c.codec = Read<uint32_t>(in);
+    }
+    index[step] = columns;
+  }
+  if (!in) {
+    std::cout << "Could not read the header of " << fn << std::endl;
+    exit(0);
+  }
+  fd = open(fn.c_str(), O_RDONLY);
+  // map the whole file; the mapping is private, so vtk can never write through to the file
+  map = NULL;
+  struct stat st;
+  if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size > 0) {
+    mapsize = (size_t) st.st_size;
+    void *p = mmap(NULL, mapsize, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (p != MAP_FAILED)
+      map = (char *) p;
+  }
+}
+
+ContainerReader::~ContainerReader() {
+  if (map != NULL)
+    munmap(map, mapsize);
+  if (fd >= 0)
+    close(fd);
+}
+
+std::vector<int> ContainerReader::GetSteps() {
+  std::vector<int> steps;
+  for (auto s : index) { steps.push_back(s.first); }
+  return steps;
+}
+
+vtkSmartPointer<vtkStructuredPoints> ContainerReader::ReadStep(int step, std::vector<std::string> names,
+                                                               std::vector<char> &buf) {
+  std::map<int, std::vector<column> >::iterator it = index.find(step);
+  if (it == index.end()) {
+    std::cout << "Step " << step << " is not stored in " << fn << std::endl;
+    exit(0);
+  }
+  vtkSmartPointer<vtkStructuredPoints> sp = vtkSmartPointer<vtkStructuredPoints>::New();
+  sp->SetDimensions(dim[0], dim[1], dim[2]);
+  sp->SetOrigin(origin);
+  sp->SetSpacing(spacing);
+  vtkIdType npoints = (vtkIdType) dim[0] * dim[1] * dim[2];
+  for (size_t i = 0; i < fields.size(); i++) {
+    if (std::find(names.begin(), names.end(), fields[i].name) == names.end())
+      continue;
+    const column &c = it->second[i];
+    vtkSmartPointer<vtkDataArray> array = vtkSmartPointer<vtkDataArray>::Take(
+        vtkDataArray::CreateDataArray(fields[i].type));
+    array->SetName(fields[i].name.c_str());
+    array->SetNumberOfComponents(fields[i].ncomp);
+    vtkIdType nvalues = npoints * fields[i].ncomp;
+    if (c.rawsize != (uint64_t) (nvalues * array->GetDataTypeSize()) || (map != NULL && c.offset + c.size > mapsize)) {
+      std::cout << "Size of " << fields[i].name << " of step " << step << " in " << fn << " is invalid" << std::endl;
+      exit(0);
+    }
+    if (map != NULL) {
+      uint64_t page = (uint64_t) sysconf(_SC_PAGESIZE);
+      madvise(map + c.offset - c.offset % page, c.size + c.offset % page, MADV_WILLNEED);
+      if (c.codec == CODEC_RAW) {
+        // wrap the mapped column without copying; save=1 keeps vtk from freeing it
+        array->SetVoidArray(map + c.offset, nvalues, 1);
+        AddArray(sp, array);
+        continue;
+      }
+    }
+    array->SetNumberOfTuples(npoints);
+    char *target = (char *) array->GetVoidPointer(0);
+    char *source = (c.codec == CODEC_RAW) ? target : NULL;
+    if (map != NULL) {
+      source = map + c.offset;
+    } else if (source == NULL) {
+      if (buf.size() < c.size) { buf.resize(c.size); }
+      source = buf.data();
+    }
+    if (map == NULL && pread(fd, source, c.size, (off_t) c.offset) != (ssize_t) c.size) {
+      std::cout << "Could not read " << fields[i].name << " of step " << step << " from " << fn << std::endl;
+      exit(0);
+    }
+    if (c.codec == CODEC_ZLIB) {
+      uLongf rawsize = (uLongf) c.rawsize;
+      if (uncompress((Bytef *) target, &rawsize, (const Bytef *) source, (uLong) c.size) != Z_OK
+          || rawsize != c.rawsize) {
+        std::cout << "Could not decompress " << fields[i].name << " of step " << step << " from " << fn << std::endl;
+        exit(0);
+      }
+    }
+    AddArray(sp, array);
+  }
+  return sp;
+}
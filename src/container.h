@@ -0,0 +1,55 @@
+//
+// Binary container for time series converted from vtk files
+//
+
+#ifndef VISGRID3D_CONTAINER_H
+#define VISGRID3D_CONTAINER_H
+
+#include <map>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <vtkSmartPointer.h>
+#include <vtkStructuredPoints.h>
+
+#include "datareader.h"
+
+// Write the given steps with all listed fields (cell.id and cell.type included) to a container, compressed
+// with the given zlib level; level 0 stores the fields raw
+void WriteContainer(std::string fn, DataReader *reader, std::vector<int> steps, std::vector<std::string> fields,
+                    int level);
+
+class ContainerReader {
+ public:
+  ContainerReader(std::string _fn);
+  ~ContainerReader();
+  std::vector<int> GetSteps();
+  // Read the requested fields of a step. Raw fields are not copied but point into the memory-mapped file,
+  // so they are only valid while the reader exists. Without a mapping, buf holds compressed data, so each
+  // thread should use its own.
+  vtkSmartPointer<vtkStructuredPoints> ReadStep(int step, std::vector<std::string> names, std::vector<char> &buf);
+
+ private:
+  struct field {
+    std::string name;
+    int32_t type;
+    int32_t ncomp;
+  };
+  struct column {
+    uint64_t offset;
+    uint64_t size;
+    uint64_t rawsize;
+    uint32_t codec;
+  };
+  std::string fn;
+  int fd;
+  char *map;
+  size_t mapsize;
+  int32_t dim[3];
+  double origin[3];
+  double spacing[3];
+  std::vector<field> fields;
+  std::map<int, std::vector<column> > index;
+};
+
+#endif //VISGRID3D_CONTAINER_H
@@ -7,15 +7,37 @@
 #include <sstream>      // std::stringstream
 #include <glob.h>
 #include <algorithm>
+#include <chrono>
+#include <cmath>
 
 #include <fstream>
 #include <boost/iostreams/filtering_streambuf.hpp>
-#include <boost/iostreams/copy.hpp>
 #include <boost/iostreams/filter/gzip.hpp>
 
 #include "datareader.h"
+#include "legacyparser.h"
+#include "prefetcher.h"
+#include "stepcache.h"
+#include "container.h"
 #include <vtkStructuredPoints.h>
 #include <vtkPointData.h>
+#include <vtkUnsignedCharArray.h>
+#include <vtkUnsignedIntArray.h>
+
+namespace {
+
+// Copy labels into a narrower type, stopping at the first one that is not a whole number
+template<class S, class T>
+bool CopyLabels(const S *src, T *dst, vtkIdType n) {
+  for (vtkIdType i = 0; i < n; i++) {
+    if (src[i] != floor(src[i]))
+      return false;
+    dst[i] = (T) src[i];
+  }
+  return true;
+}
+
+}
 
 
 DataReader::DataReader() {
@@ -23,6 +45,11 @@ DataReader::DataReader() {
   datapath = "./";
   gzip = false;
   suffix = ".vtk";
+  readmode = READ_NATIVE;
+  timing = false;
+  prefetcher = NULL;
+  cache = NULL;
+  container = NULL;
 }
 
 DataReader::DataReader(std::string _basename, std::string _datapath, std::vector<std::string> _extra_fields, bool _gzip) {
@@ -31,9 +58,28 @@ DataReader::DataReader(std::string _basename, std::string _datapath, std::vector
   extra_fields = _extra_fields;
   gzip = _gzip;
   suffix = gzip ? ".vtk.gz" : ".vtk";
+  readmode = READ_NATIVE;
+  timing = false;
+  prefetcher = NULL;
+  cache = NULL;
+  container = NULL;
+  if (IsContainer(datapath))
+    container = new ContainerReader(datapath);
+}
+
+bool IsContainer(std::string path) {
+  return path.size() > 5 && path.compare(path.size() - 5, 5, ".vg3d") == 0;
+}
+
+DataReader::~DataReader() {
+  delete prefetcher;
+  delete cache;
+  delete container;
 }
 
 std::vector<int> DataReader::FindSteps() {
+  if (container != NULL)
+    return container->GetSteps();
   glob_t globbuf;
   int err = glob((datapath + basename + "_*" + suffix).c_str(), 0, NULL, &globbuf);
   std::vector<int> steps;
@@ -48,50 +94,232 @@ std::vector<int> DataReader::FindSteps() {
   return steps;
 }
 
+std::vector<std::string> DataReader::FindFields(int step) {
+  std::vector<std::string> fields;
+  if (container != NULL)
+    return fields;
+  vtkSmartPointer<vtkStructuredPointsReader> reader = OpenVtkReader(GetFileNameForStep(step), buffer);
+  for (int i = 0; i < reader->GetNumberOfScalarsInFile(); i++)
+    fields.push_back(reader->GetScalarsNameInFile(i));
+  return fields;
+}
+
+void DataReader::SetExtraFields(std::vector<std::string> _extra_fields) {
+  extra_fields = _extra_fields;
+}
+
+std::vector<std::string> DataReader::GetRequiredFields() {
+  std::vector<std::string> names = {"cell.id", "cell.type"};
+  for (auto f : extra_fields) {
+    if (f.compare("none") != 0)
+      names.push_back(f);
+  }
+  return names;
+}
+
 std::string DataReader::GetFileNameForStep(int step) {
+  if (container != NULL)
+    return datapath;
   std::stringstream num;
   num << std::setfill('0') << std::setw(6);
   num << step;
   return datapath + basename + "_" + num.str() + suffix;
 }
 
-stepdata DataReader::GetDataForStep(int step) {
-//  if (data.find(step) == data.end()){ ReadData(step); }
-  return ReadData(step);
+stepdata_ptr DataReader::GetDataForStep(int step) {
+  stepdata_ptr data;
+  if (cache != NULL)
+    data = cache->Get(step);
+  if (data == NULL) {
+    stepdata sd;
+    if (prefetcher == NULL || !prefetcher->Take(step, sd))
+      sd = ReadData(step);
+    data = std::make_shared<stepdata>(sd);
+    if (cache != NULL)
+      cache->Put(step, data);
+  }
+  if (prefetcher != NULL)
+    prefetcher->Schedule(step);
+  return data;
+}
+
+void DataReader::EnableCache(size_t max_bytes) {
+  delete cache;
+  cache = new StepCache(max_bytes);
+}
+
+bool DataReader::IsCached(int step) {
+  return cache != NULL && cache->Contains(step);
 }
 
+void DataReader::PrintCacheStats() {
+  if (cache != NULL)
+    cache->PrintStats();
+}
+
+void DataReader::EnablePrefetch(std::vector<int> steps, int depth, size_t max_bytes) {
+  delete prefetcher;
+  prefetcher = new Prefetcher(this, steps, depth, max_bytes);
+}
 
 stepdata DataReader::ReadData(int step) {
-  reader = vtkSmartPointer<vtkStructuredPointsReader>::New();
+  return ReadData(step, buffer);
+}
+
+stepdata DataReader::ReadData(int step, std::vector<char> &buf) {
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
   std::string fn = GetFileNameForStep(step);
+  stepdata sd;
+  if (container != NULL)
+    sd.sp = container->ReadStep(step, GetRequiredFields(), buf);
+  else if (readmode == READ_NATIVE)
+    sd.sp = ReadNative(fn, buf);
+  if (sd.sp == NULL) {
+    vtkSmartPointer<vtkStructuredPointsReader> reader = OpenVtkReader(fn, buf);
+    std::vector<std::string> fields;
+    for (int i = 0; i < reader->GetNumberOfScalarsInFile(); i++)
+      fields.push_back(reader->GetScalarsNameInFile(i));
+    sd.sp = reader->GetOutput();
+    if (readmode == READ_MULTIPASS) {
+      sd.sigma = GetArrayFromFile(reader, fields, fn, "cell.id");
+      sd.tau = GetArrayFromFile(reader, fields, fn, "cell.type");
+      for (auto f : extra_fields) {
+        if (f.compare("none") != 0)
+          sd.extra_fields[f] = GetArrayFromFile(reader, fields, fn, f);
+      }
+    } else {
+      // load all scalars with a single pass over the file
+      reader->ReadAllScalarsOn();
+      reader->Update();
+    }
+  }
+  if (sd.sigma == NULL) {
+    sd.sigma = GetArrayFromOutput(sd.sp, fn, "cell.id");
+    sd.tau = GetArrayFromOutput(sd.sp, fn, "cell.type");
+    for (auto f : extra_fields) {
+      if (f.compare("none") != 0)
+        sd.extra_fields[f] = GetArrayFromOutput(sd.sp, fn, f);
+    }
+  }
+  sd.sigma = NarrowLabels(sd.sp, sd.sigma, false);
+  sd.tau = NarrowLabels(sd.sp, sd.tau, true);
+  if (timing) {
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    std::stringstream msg;
+    msg << "Read step " << step << " in " << elapsed.count() << " ms\n";
+    std::cout << msg.str() << std::flush;
+  }
+  return sd;
+}
+
+vtkSmartPointer<vtkStructuredPoints> DataReader::ReadNative(std::string fn, std::vector<char> &buf) {
+  size_t len = LoadFile(fn, buf);
+  LegacyParser parser;
+  vtkSmartPointer<vtkStructuredPoints> sp = parser.Parse(buf.data(), len, GetRequiredFields());
+  if (sp == NULL) {
+    std::cout << "Native parser can not read " << fn << " (" << parser.error << ")"
+              << " - switch to the vtk reader" << std::endl;
+    readmode = READ_SINGLEPASS;
+  }
+  return sp;
+}
+
+vtkSmartPointer<vtkStructuredPointsReader> DataReader::OpenVtkReader(std::string fn, std::vector<char> &buf) {
+  vtkSmartPointer<vtkStructuredPointsReader> reader = vtkSmartPointer<vtkStructuredPointsReader>::New();
   if (gzip){
+    // vtk keeps its own copy of the string, so the buffer can be reused for the next step
+    size_t len = LoadFile(fn, buf);
     reader->ReadFromInputStringOn();
-    std::ifstream file(fn, std::ios_base::in | std::ios_base::binary);
-    boost::iostreams::filtering_streambuf<boost::iostreams::input> in;
-    in.push(boost::iostreams::gzip_decompressor());
-    in.push(file);
-    std::stringstream dst;
-    boost::iostreams::copy(in, dst);
-    reader->SetInputString(dst.str().c_str());
+    reader->SetInputString(buf.data(), (int) len);
   }
   else {
     reader->SetFileName(fn.c_str());
   }
-  for (int i = 0; i < reader->GetNumberOfScalarsInFile(); i++)
-    fields.push_back(reader->GetScalarsNameInFile(i));
-  stepdata sd;
-  sd.sp = reader->GetOutput();
-  sd.sigma = GetArrayFromFile("cell.id");
-  sd.tau = GetArrayFromFile("cell.type");
-  for (auto f : extra_fields) {
-    if (f.compare("none") != 0)
-      sd.extra_fields[f] = GetArrayFromFile(f);
+  return reader;
+}
+
+size_t DataReader::LoadFile(std::string fn, std::vector<char> &buf) {
+  std::ifstream file(fn, std::ios_base::in | std::ios_base::binary | std::ios_base::ate);
+  if (!file) {
+    std::cout << "Could not open " << fn << std::endl;
+    exit(0);
   }
-  return sd;
+  size_t filesize = (size_t) file.tellg();
+  size_t len = 0;
+  if (gzip) {
+    // the gzip trailer holds the uncompressed size (modulo 2^32), use it to size the buffer in one go
+    size_t expected = filesize;
+    if (filesize >= 18) {
+      unsigned char isize[4];
+      file.seekg(filesize - 4);
+      file.read((char *) isize, 4);
+      expected = std::max(expected, (size_t) isize[0] | (size_t) isize[1] << 8 | (size_t) isize[2] << 16 |
+          (size_t) isize[3] << 24);
+    }
+    if (buf.size() < expected + 1) { buf.resize(expected + 1); }
+    file.seekg(0);
+    // decompress chunk by chunk straight into the buffer
+    boost::iostreams::filtering_streambuf<boost::iostreams::input> in;
+    in.push(boost::iostreams::gzip_decompressor());
+    in.push(file);
+    std::streamsize n;
+    while (true) {
+      if (buf.size() - len < 2) { buf.resize(2 * buf.size()); }
+      n = in.sgetn(&buf[len], (std::streamsize) (buf.size() - len - 1));
+      if (n <= 0) { break; }
+      len += (size_t) n;
+    }
+  } else {
+    if (buf.size() < filesize + 1) { buf.resize(filesize + 1); }
+    file.seekg(0);
+    file.read(buf.data(), filesize);
+    len = (size_t) file.gcount();
+  }
+  buf[len] = '\0';
+  return len;
 }
 
+vtkSmartPointer<vtkDataArray> DataReader::NarrowLabels(vtkSmartPointer<vtkStructuredPoints> sp,
+                                                       vtkSmartPointer<vtkDataArray> labels, bool types) {
+  int datatype = labels->GetDataType();
+  if (datatype == VTK_UNSIGNED_CHAR || (!types && datatype == VTK_UNSIGNED_INT) || labels->GetNumberOfComponents() != 1)
+    return labels;
+  double range[2];
+  labels->GetRange(range);
+  if (range[0] < 0)
+    return labels;
+  vtkSmartPointer<vtkDataArray> narrow;
+  bool uchar = types && range[1] <= VTK_UNSIGNED_CHAR_MAX;
+  if (uchar)
+    narrow = vtkSmartPointer<vtkUnsignedCharArray>::New();
+  else if (range[1] <= VTK_UNSIGNED_INT_MAX && datatype != VTK_UNSIGNED_INT)
+    narrow = vtkSmartPointer<vtkUnsignedIntArray>::New();
+  else
+    return labels;
+  vtkIdType n = labels->GetNumberOfTuples();
+  narrow->SetName(labels->GetName());
+  narrow->SetNumberOfTuples(n);
+  void *dst = narrow->GetVoidPointer(0);
+  bool whole;
+  switch (datatype) {
+    vtkTemplateMacro(whole = uchar
+        ? CopyLabels(static_cast<VTK_TT *>(labels->GetVoidPointer(0)), (unsigned char *) dst, n)
+        : CopyLabels(static_cast<VTK_TT *>(labels->GetVoidPointer(0)), (unsigned int *) dst, n));
+    default:
+      return labels;
+  }
+  // fractional labels are kept as they are, narrowing would change them
+  if (!whole)
+    return labels;
+  // replace the wide array in the point data, so its memory is released
+  if (sp->GetPointData()->GetArray(labels->GetName()) == labels)
+    sp->GetPointData()->AddArray(narrow);
+  return narrow;
+}
 
-vtkSmartPointer<vtkDataArray> DataReader::GetArrayFromFile(std::string name) {
+vtkSmartPointer<vtkDataArray> DataReader::GetArrayFromFile(vtkSmartPointer<vtkStructuredPointsReader> reader,
+                                                           std::vector<std::string> &fields, std::string fn,
+                                                           std::string name) {
   if (std::find(fields.begin(), fields.end(), name) != fields.end()) {
     reader->SetScalarsName(name.c_str());
     reader->Update();  //I think this actually makes the reader do something
@@ -100,8 +328,29 @@ vtkSmartPointer<vtkDataArray> DataReader::GetArrayFromFile(std::string name) {
     pd->Update();
     return pd->GetScalars(name.c_str());
   } else {
-    std::cout << "Could not find array " << name << " in " << reader->GetFileName() << std::endl;
+    std::cout << "Could not find array " << name << " in " << fn << std::endl;
     exit(0);
   }
 };
 
+vtkSmartPointer<vtkDataArray> DataReader::GetArrayFromOutput(vtkSmartPointer<vtkStructuredPoints> sp,
+                                                             std::string fn, std::string name) {
+  vtkSmartPointer<vtkDataArray> array = sp->GetPointData()->GetArray(name.c_str());
+  if (array == NULL) {
+    std::cout << "Could not find array " << name << " in " << fn << std::endl;
+    exit(0);
+  }
+  return array;
+}
+
+size_t StepBytes(const stepdata &sd) {
+  std::vector<vtkDataArray *> arrays = {sd.sigma, sd.tau};
+  for (auto f : sd.extra_fields) { arrays.push_back(f.second); }
+  std::sort(arrays.begin(), arrays.end());
+  arrays.erase(std::unique(arrays.begin(), arrays.end()), arrays.end());
+  size_t kib = 0;
+  for (auto a : arrays) {
+    if (a != NULL) { kib += a->GetActualMemorySize(); }
+  }
+  return 1024 * kib;
+}
@@ -5,7 +5,9 @@
 #ifndef VISGRID3D_READER_H
 #define VISGRID3D_READER_H
 
+#include <atomic>
 #include <map>
+#include <memory>
 #include <string>
 #include <vector>
 #include <vtkSmartPointer.h>
@@ -13,6 +15,13 @@
 #include <vtkDataArray.h>
 
 
+// Strategy used to pull the scalar arrays out of a vtk file
+enum ReadMode {
+  READ_MULTIPASS,   // re-parse the file for every requested array
+  READ_SINGLEPASS,  // parse the file once and collect all arrays
+  READ_NATIVE       // parse the file with LegacyParser instead of vtk
+};
+
 struct stepdata {
   vtkSmartPointer<vtkStructuredPoints> sp;
   vtkSmartPointer<vtkDataArray> sigma;
@@ -20,24 +29,63 @@ struct stepdata {
   std::map<std::string, vtkSmartPointer<vtkDataArray> > extra_fields;
 };
 
+// Steps are shared between the cache and the visualizer without copying
+typedef std::shared_ptr<const stepdata> stepdata_ptr;
+
+// Approximate memory held by the arrays of a step
+size_t StepBytes(const stepdata &sd);
+
+// Check whether a path points to a binary container instead of a folder with vtk files
+bool IsContainer(std::string path);
+
+class Prefetcher;
+class StepCache;
+class ContainerReader;
+
 class DataReader {
  public:
   DataReader();
   DataReader(std::string _basename, std::string _datapath, std::vector<std::string> _extra_fields, bool _gzip);
+  ~DataReader();
   std::vector<int> FindSteps();
-  stepdata GetDataForStep(int step);
+  // Names of the scalar arrays stored for a step
+  std::vector<std::string> FindFields(int step);
+  void SetExtraFields(std::vector<std::string> _extra_fields);
+  stepdata_ptr GetDataForStep(int step);
   stepdata ReadData(int step);
+  // ReadData may be called from several threads at once as long as each passes its own buffer
+  stepdata ReadData(int step, std::vector<char> &buf);
+  // Read up to depth steps ahead of the one requested in GetDataForStep, following the order in steps
+  void EnablePrefetch(std::vector<int> steps, int depth, size_t max_bytes);
+  // Keep decoded steps in memory up to max_bytes
+  void EnableCache(size_t max_bytes);
+  bool IsCached(int step);
+  void PrintCacheStats();
+  std::atomic<ReadMode> readmode;
+  bool timing;
 
  private:
-  vtkSmartPointer<vtkDataArray> GetArrayFromFile(std::string name);
-  vtkSmartPointer<vtkStructuredPointsReader> reader;
+  vtkSmartPointer<vtkDataArray> GetArrayFromFile(vtkSmartPointer<vtkStructuredPointsReader> reader,
+                                                 std::vector<std::string> &fields, std::string fn, std::string name);
+  vtkSmartPointer<vtkDataArray> GetArrayFromOutput(vtkSmartPointer<vtkStructuredPoints> sp, std::string fn,
+                                                   std::string name);
+  // Store cell types as unsigned char and cell ids as unsigned int when their values allow it
+  vtkSmartPointer<vtkDataArray> NarrowLabels(vtkSmartPointer<vtkStructuredPoints> sp,
+                                             vtkSmartPointer<vtkDataArray> labels, bool types);
+  vtkSmartPointer<vtkStructuredPoints> ReadNative(std::string fn, std::vector<char> &buf);
+  vtkSmartPointer<vtkStructuredPointsReader> OpenVtkReader(std::string fn, std::vector<char> &buf);
+  std::vector<std::string> GetRequiredFields();
+  size_t LoadFile(std::string fn, std::vector<char> &buf);
   std::string GetFileNameForStep(int step);
-  std::vector<std::string> fields;
   std::vector<std::string> extra_fields;
   std::string basename;
   std::string datapath;
   bool gzip;
   std::string suffix;
+  std::vector<char> buffer;  // file contents, reused between steps
+  Prefetcher *prefetcher;
+  StepCache *cache;
+  ContainerReader *container;
 
 };
 
@@ -0,0 +1,107 @@
+//
+// Coarse versions of time steps for drawing at a lower level of detail
+//
+
+#include "downsample.h"
+#include "parallel.h"
+
+#include <algorithm>
+#include <vtkPointData.h>
+
+namespace {
+
+// For every block, find the voxel that represents it: the first voxel with the most common label of the block
+template<class T>
+void VoteLabels(const T *labels, const int *dim, const int *cdim, int factor, std::vector<vtkIdType> &voxel,
+                int nthreads) {
+  ParallelFor(cdim[2], nthreads, [&](long long begin, long long end, int) {
+    std::vector<std::pair<T, vtkIdType> > block;
+    for (int cz = (int) begin; cz < end; cz++) {
+      for (int cy = 0; cy < cdim[1]; cy++) {
+        for (int cx = 0; cx < cdim[0]; cx++) {
+          block.clear();
+          for (int z = cz * factor; z < std::min((cz + 1) * factor, dim[2]); z++) {
+            for (int y = cy * factor; y < std::min((cy + 1) * factor, dim[1]); y++) {
+              vtkIdType row = ((vtkIdType) z * dim[1] + y) * dim[0];
+              for (int x = cx * factor; x < std::min((cx + 1) * factor, dim[0]); x++) {
+                block.push_back({labels[row + x], row + x});
+              }
+            }
+          }
+          // sorting groups the labels, with the first voxel of each label in front
+          std::sort(block.begin(), block.end());
+          size_t best = 0, bestcount = 0;
+          for (size_t i = 0; i < block.size();) {
+            size_t j = i;
+            while (j < block.size() && block[j].first == block[i].first) { j++; }
+            if (j - i > bestcount) {
+              best = i;
+              bestcount = j - i;
+            }
+            i = j;
+          }
+          voxel[cx + cdim[0] * (cy + (vtkIdType) cdim[1] * cz)] = block[best].second;
+        }
+      }
+    }
+  });
+}
+
+template<class T>
+void GatherValues(const T *source, T *target, int ncomp, const std::vector<vtkIdType> &voxel, int nthreads) {
+  ParallelFor((long long) voxel.size(), nthreads, [&](long long begin, long long end, int) {
+    for (long long i = begin; i < end; i++) {
+      for (int c = 0; c < ncomp; c++) { target[i * ncomp + c] = source[voxel[i] * ncomp + c]; }
+    }
+  }, voxel_grain);
+}
+
+// Copy the values of the representative voxels into a new array of the same type
+vtkSmartPointer<vtkDataArray> Gather(vtkDataArray *source, const std::vector<vtkIdType> &voxel, int nthreads) {
+  vtkSmartPointer<vtkDataArray> array = vtkSmartPointer<vtkDataArray>::Take(
+      vtkDataArray::CreateDataArray(source->GetDataType()));
+  array->SetName(source->GetName());
+  int ncomp = source->GetNumberOfComponents();
+  array->SetNumberOfComponents(ncomp);
+  array->SetNumberOfTuples((vtkIdType) voxel.size());
+  switch (source->GetDataType()) {
+    vtkTemplateMacro(GatherValues(static_cast<VTK_TT *>(source->GetVoidPointer(0)),
+                                  static_cast<VTK_TT *>(array->GetVoidPointer(0)), ncomp, voxel, nthreads));
+  }
+  return array;
+}
+}
+
+stepdata_ptr Downsample(const stepdata &data, int factor, int nthreads) {
+  int *dim = data.sp->GetDimensions();
+  double *origin = data.sp->GetOrigin();
+  double *spacing = data.sp->GetSpacing();
+  int cdim[3];
+  double corigin[3], cspacing[3];
+  for (int j = 0; j < 3; j++) {
+    cdim[j] = (dim[j] + factor - 1) / factor;
+    // a coarse voxel sits in the middle of the block it replaces
+    corigin[j] = origin[j] + spacing[j] * (factor - 1) / 2.0;
+    cspacing[j] = spacing[j] * factor;
+  }
+  std::vector<vtkIdType> voxel((size_t) cdim[0] * cdim[1] * cdim[2]);
+  switch (data.tau->GetDataType()) {
+    vtkTemplateMacro(VoteLabels(static_cast<VTK_TT *>(data.tau->GetVoidPointer(0)), dim, cdim, factor, voxel,
+                                nthreads));
+  }
+
+  std::shared_ptr<stepdata> coarse = std::make_shared<stepdata>();
+  coarse->sp = vtkSmartPointer<vtkStructuredPoints>::New();
+  coarse->sp->SetDimensions(cdim);
+  coarse->sp->SetOrigin(corigin);
+  coarse->sp->SetSpacing(cspacing);
+  coarse->tau = Gather(data.tau, voxel, nthreads);
+  coarse->sigma = Gather(data.sigma, voxel, nthreads);
+  coarse->sp->GetPointData()->SetScalars(coarse->tau);
+  coarse->sp->GetPointData()->AddArray(coarse->sigma);
+  for (auto f : data.extra_fields) {
+    coarse->extra_fields[f.first] = Gather(f.second, voxel, nthreads);
+    coarse->sp->GetPointData()->AddArray(coarse->extra_fields[f.first]);
+  }
+  return coarse;
+}
@@ -0,0 +1,14 @@
+//
+// Coarse versions of time steps for drawing at a lower level of detail
+//
+
+#ifndef VISGRID3D_DOWNSAMPLE_H
+#define VISGRID3D_DOWNSAMPLE_H
+
+#include "datareader.h"
+
+// Merge blocks of factor^3 voxels into one. Each block takes the most common cell type in it, and the cell id
+// and fields of the first voxel of the block with that type.
+stepdata_ptr Downsample(const stepdata &data, int factor, int nthreads);
+
+#endif //VISGRID3D_DOWNSAMPLE_H
@@ -0,0 +1,72 @@
+//
+// Writes rendered frames to image files on a pool of threads
+//
+
+#include "framewriter.h"
+
+#include <iostream>
+#include <fstream>
+#include <vtkPNGWriter.h>
+
+FrameWriter::FrameWriter(int nthreads, size_t depth, std::string _format, int _level) : queue(depth) {
+  format = _format;
+  level = std::min(std::max(_level, 0), 9);
+  for (int i = 0; i < std::max(nthreads, 1); i++)
+    workers.push_back(std::thread(&FrameWriter::Work, this));
+}
+
+FrameWriter::~FrameWriter() {
+  queue.Close();
+  for (auto &w : workers) { w.join(); }
+}
+
+void FrameWriter::Write(std::string fn, vtkSmartPointer<vtkImageData> image) {
+  queue.Push({fn, image});
+}
+
+void FrameWriter::Work() {
+  frame f;
+  while (queue.Pop(f)) {
+    if (format.compare("png") == 0)
+      WritePNG(f);
+    else
+      WriteRGB(f, format.compare("ppm") == 0);
+    f.image = NULL;
+  }
+}
+
+void FrameWriter::WritePNG(const frame &f) {
+  // every frame gets its own writer, so the threads share no vtk objects
+  vtkSmartPointer<vtkPNGWriter> writer = vtkSmartPointer<vtkPNGWriter>::New();
+  writer->SetFileName(f.fn.c_str());
+#if VTK_MAJOR_VERSION > 8 || (VTK_MAJOR_VERSION == 8 && VTK_MINOR_VERSION >= 1)
+  writer->SetCompressionLevel(level);
+#endif
+#if VTK_MAJOR_VERSION <= 5
+  writer->SetInput(f.image);
+#else
+  writer->SetInputData(f.image);
+#endif
+  writer->Write();
+}
+
+void FrameWriter::WriteRGB(const frame &f, bool header) {
+  int *dim = f.image->GetDimensions();
+  int ncomp = f.image->GetNumberOfScalarComponents();
+  const unsigned char *pixels = static_cast<unsigned char *>(f.image->GetScalarPointer());
+  std::ofstream out(f.fn, std::ios_base::out | std::ios_base::binary | std::ios_base::trunc);
+  if (header)
+    out << "P6\n" << dim[0] << " " << dim[1] << "\n255\n";
+  // images start at the bottom row, files at the top
+  std::vector<char> row(3 * (size_t) dim[0]);
+  for (int y = dim[1] - 1; y >= 0; y--) {
+    const unsigned char *p = pixels + (size_t) y * dim[0] * ncomp;
+    for (int x = 0; x < dim[0]; x++) {
+      for (int j = 0; j < 3; j++) { row[3 * x + j] = p[ncomp * x + std::min(j, ncomp - 1)]; }
+    }
+    out.write(row.data(), row.size());
+  }
+  out.close();
+  if (!out)
+    std::cout << "Could not write " << f.fn << std::endl;
+}
@@ -0,0 +1,40 @@
+//
+// Writes rendered frames to image files on a pool of threads
+//
+
+#ifndef VISGRID3D_FRAMEWRITER_H
+#define VISGRID3D_FRAMEWRITER_H
+
+#include <string>
+#include <thread>
+#include <vector>
+#include <vtkSmartPointer.h>
+#include <vtkImageData.h>
+
+#include "boundedqueue.h"
+
+class FrameWriter {
+ public:
+  // Encode frames on nthreads threads, with up to depth frames waiting for a thread. Frames are written as png
+  // with the given zlib level (0-9), as binary ppm or as raw rgb bytes with the top row first.
+  FrameWriter(int nthreads, size_t depth, std::string _format, int _level);
+  // Wait until every frame is written
+  ~FrameWriter();
+  // Queue a frame, waiting while the queue is full. The writer takes over the image.
+  void Write(std::string fn, vtkSmartPointer<vtkImageData> image);
+
+ private:
+  struct frame {
+    std::string fn;
+    vtkSmartPointer<vtkImageData> image;
+  };
+  void Work();
+  void WritePNG(const frame &f);
+  void WriteRGB(const frame &f, bool header);
+  std::string format;
+  int level;
+  BoundedQueue<frame> queue;
+  std::vector<std::thread> workers;
+};
+
+#endif //VISGRID3D_FRAMEWRITER_H
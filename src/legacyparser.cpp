@@ -0,0 +1,388 @@
+//
+// Fast parser for the legacy ascii STRUCTURED_POINTS files written by Morpheus' VtkPlotter
+//
+
+#include "legacyparser.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <stdint.h>
+
+#include <vtkPointData.h>
+#include <vtkIntArray.h>
+#include <vtkUnsignedCharArray.h>
+#include <vtkUnsignedIntArray.h>
+#include <vtkFloatArray.h>
+#include <vtkDoubleArray.h>
+
+namespace {
+
+// powers of ten that are exactly representable as double
+const double exact_pow10[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+                              1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+
+inline bool IsSpace(char c) { return c == ' ' || c == '\n' || c == '\r' || c == '\t'; }
+
+inline bool IsDigit(char c) { return (unsigned) (c - '0') < 10; }
+
+inline const char *SkipSpace(const char *p, const char *end) {
+  while (p < end && IsSpace(*p)) { ++p; }
+  return p;
+}
+
+// Scan a decimal integer at p; returns the position after the number or NULL if there is none
+inline const char *ScanInt(const char *p, const char *end, long long &value) {
+  bool neg = false;
+  if (p < end && (*p == '-' || *p == '+')) {
+    neg = (*p == '-');
+    ++p;
+  }
+  const char *start = p;
+  long long v = 0;
+  while (p < end && IsDigit(*p)) {
+    v = 10 * v + (*p - '0');
+    ++p;
+  }
+  if (p == start) { return NULL; }
+  value = neg ? -v : v;
+  return p;
+}
+
+// Scan a floating point number at p; returns the position after the number or NULL if there is none.
+// Numbers with at most 19 significant digits and a small exponent are converted exactly without
+// touching the C library, everything else falls back to strtod.
+inline const char *ScanDouble(const char *p, const char *end, double &value) {
+  const char *start = p;
+  bool neg = false;
+  if (p < end && (*p == '-' || *p == '+')) {
+    neg = (*p == '-');
+    ++p;
+  }
+  uint64_t mantissa = 0;
+  int ndigits = 0;
+  int exp10 = 0;
+  bool any = false;
+  bool exact = true;
+  while (p < end && IsDigit(*p)) {
+    any = true;
+    if (ndigits < 19) {
+      mantissa = 10 * mantissa + (*p - '0');
+      if (mantissa) { ndigits++; }
+    } else {
+      exp10++;
+      exact = false;
+    }
+    ++p;
+  }
+  if (p < end && *p == '.') {
+    ++p;
+    while (p < end && IsDigit(*p)) {
+      any = true;
+      if (ndigits < 19) {
+        mantissa = 10 * mantissa + (*p - '0');
+        if (mantissa) { ndigits++; }
+        exp10--;
+      } else if (*p != '0') {
+        exact = false;
+      }
+      ++p;
+    }
+  }
+  if (any && p < end && (*p == 'e' || *p == 'E')) {
+    long long e;
+    const char *q = ScanInt(p + 1, end, e);
+    if (q == NULL) { return NULL; }
+    if (e > 10000 || e < -10000) { exact = false; }
+    else { exp10 += (int) e; }
+    p = q;
+  }
+  if (any && exact && mantissa <= (1ULL << 53) && exp10 >= -22 && exp10 <= 22) {
+    double d = (double) mantissa;
+    d = (exp10 < 0) ? d / exact_pow10[-exp10] : d * exact_pow10[exp10];
+    value = neg ? -d : d;
+    return p;
+  }
+  // long mantissas, large exponents, nan and inf
+  char *stop;
+  value = strtod(start, &stop);
+  return (stop == start) ? NULL : stop;
+}
+
+// Scan n integers (or floats holding whole numbers) into out, stopping before the first value that does not fit
+// in T. Returns the number of values scanned, or -1 if a value could not be read or is not a whole number.
+template<class T>
+vtkIdType ScanIntegers(const char *&pos, const char *end, vtkIdType n, bool integers, T *out) {
+  const char *p = pos;
+  for (vtkIdType i = 0; i < n; i++) {
+    long long v;
+    const char *q = SkipSpace(p, end);
+    if (integers) {
+      q = ScanInt(q, end, v);
+    } else {
+      double d;
+      q = ScanDouble(q, end, d);
+      if (q != NULL && d != floor(d))
+        q = NULL;
+      if (q != NULL)
+        v = (long long) d;
+    }
+    if (q == NULL) {
+      pos = p;
+      return -1;
+    }
+    if (v < (long long) std::numeric_limits<T>::min() || v > (long long) std::numeric_limits<T>::max()) {
+      pos = p;
+      return i;
+    }
+    out[i] = (T) v;
+    p = q;
+  }
+  pos = p;
+  return n;
+}
+
+// Continue scanning the values of prev (of which done are read) into a wider array of type A
+template<class A, class T>
+vtkSmartPointer<vtkDataArray> Widen(vtkSmartPointer<vtkDataArray> prev, vtkIdType &done, const char *&pos,
+                                    const char *end, vtkIdType npoints, int ncomp, bool integers) {
+  vtkSmartPointer<A> a = vtkSmartPointer<A>::New();
+  a->SetNumberOfComponents(ncomp);
+  a->SetNumberOfTuples(npoints);
+  T *out = a->GetPointer(0);
+  for (vtkIdType i = 0; i < done; i++) { out[i] = (T) prev->GetComponent(i / ncomp, i % ncomp); }
+  vtkIdType n = ScanIntegers(pos, end, npoints * ncomp - done, integers, out + done);
+  if (n < 0) { return NULL; }
+  done += n;
+  return a;
+}
+
+bool IsIntegerType(std::string type) {
+  return type != "float" && type != "double";
+}
+
+bool IsKnownType(std::string type) {
+  static const char *types[] = {"bit", "unsigned_char", "char", "unsigned_short", "short", "unsigned_int", "int",
+                                "unsigned_long", "long", "vtktypeint64", "vtktypeuint64", "vtkidtype", "float",
+                                "double"};
+  for (auto t : types) {
+    if (type == t) { return true; }
+  }
+  return false;
+}
+
+std::string ToLower(std::string s) {
+  std::transform(s.begin(), s.end(), s.begin(), ::tolower);
+  return s;
+}
+
+}
+
+
+vtkSmartPointer<vtkDataArray> LegacyParser::ReadIntegers(vtkIdType npoints, int ncomp, bool integers, int width) {
+  // start with an array of the given width and widen it when a value does not fit
+  vtkIdType nvalues = npoints * ncomp;
+  vtkIdType done = 0;
+  vtkSmartPointer<vtkDataArray> array;
+  if (width == 1) {
+    array = Widen<vtkUnsignedCharArray, unsigned char>(array, done, pos, end, npoints, ncomp, integers);
+    if (array == NULL || done == nvalues) { return array; }
+  }
+  if (width == 1 || width == 4) {
+    array = Widen<vtkUnsignedIntArray, unsigned int>(array, done, pos, end, npoints, ncomp, integers);
+    if (array == NULL || done == nvalues) { return array; }
+  }
+  array = Widen<vtkIntArray, int>(array, done, pos, end, npoints, ncomp, integers);
+  return (done == nvalues) ? array : NULL;
+}
+
+bool LegacyParser::Fail(std::string msg) {
+  error = msg;
+  return false;
+}
+
+bool LegacyParser::NextWord(std::string &word) {
+  pos = SkipSpace(pos, end);
+  const char *start = pos;
+  while (pos < end && *pos != '\0' && !IsSpace(*pos)) { ++pos; }
+  word.assign(start, pos);
+  return !word.empty();
+}
+
+bool LegacyParser::NextLine() {
+  const char *nl = (const char *) memchr(pos, '\n', end - pos);
+  if (nl == NULL) { return false; }
+  pos = nl + 1;
+  return true;
+}
+
+vtkSmartPointer<vtkStructuredPoints> LegacyParser::Parse(const char *buf, size_t len, std::vector<std::string> names) {
+  pos = buf;
+  end = buf + len;
+  error.clear();
+  std::string word;
+  const char magic[] = "# vtk DataFile Version";
+  if (len < sizeof(magic) - 1 || strncmp(buf, magic, sizeof(magic) - 1) != 0) {
+    Fail("not a legacy vtk file");
+    return NULL;
+  }
+  // skip version and title
+  if (!NextLine() || !NextLine()) {
+    Fail("truncated header");
+    return NULL;
+  }
+  if (!NextWord(word) || ToLower(word) != "ascii") {
+    Fail("only ascii files are supported");
+    return NULL;
+  }
+  if (!NextWord(word) || ToLower(word) != "dataset" || !NextWord(word) || ToLower(word) != "structured_points") {
+    Fail("dataset is not STRUCTURED_POINTS");
+    return NULL;
+  }
+
+  vtkSmartPointer<vtkStructuredPoints> sp = vtkSmartPointer<vtkStructuredPoints>::New();
+  int dim[3] = {0, 0, 0};
+  double origin[3] = {0, 0, 0};
+  double spacing[3] = {1, 1, 1};
+  vtkIdType npoints = -1;
+  while (npoints < 0 && NextWord(word)) {
+    word = ToLower(word);
+    if (word == "dimensions") {
+      for (int i = 0; i < 3; i++) {
+        long long v;
+        const char *p = ScanInt(SkipSpace(pos, end), end, v);
+        if (p == NULL) {
+          Fail("could not read dimensions");
+          return NULL;
+        }
+        dim[i] = (int) v;
+        pos = p;
+      }
+    } else if (word == "spacing" || word == "aspect_ratio" || word == "origin") {
+      double *target = (word == "origin") ? origin : spacing;
+      for (int i = 0; i < 3; i++) {
+        const char *p = ScanDouble(SkipSpace(pos, end), end, target[i]);
+        if (p == NULL) {
+          Fail("could not read " + word);
+          return NULL;
+        }
+        pos = p;
+      }
+    } else if (word == "point_data") {
+      long long n;
+      const char *p = ScanInt(SkipSpace(pos, end), end, n);
+      if (p == NULL) {
+        Fail("could not read number of points");
+        return NULL;
+      }
+      npoints = (vtkIdType) n;
+      pos = p;
+    } else {
+      Fail("unsupported keyword " + word);
+      return NULL;
+    }
+  }
+  if (npoints != (vtkIdType) dim[0] * dim[1] * dim[2]) {
+    Fail("number of points does not match the dimensions");
+    return NULL;
+  }
+  sp->SetDimensions(dim);
+  sp->SetOrigin(origin);
+  sp->SetSpacing(spacing);
+
+  while (NextWord(word)) {
+    if (ToLower(word) != "scalars") {
+      Fail("unsupported point data " + word);
+      return NULL;
+    }
+    std::string name;
+    if (!NextWord(name)) {
+      Fail("missing scalars name");
+      return NULL;
+    }
+    bool wanted = std::find(names.begin(), names.end(), name) != names.end();
+    if (!ReadScalars(sp, npoints, name, wanted)) { return NULL; }
+  }
+  return sp;
+}
+
+bool LegacyParser::ReadScalars(vtkSmartPointer<vtkStructuredPoints> sp, vtkIdType npoints, std::string name,
+                               bool wanted) {
+  std::string type;
+  if (!NextWord(type) || !IsKnownType(ToLower(type))) { return Fail("unknown data type for " + name); }
+  type = ToLower(type);
+  // optional number of components, followed by the lookup table
+  int ncomp = 1;
+  std::string word;
+  if (!NextWord(word)) { return Fail("truncated scalars " + name); }
+  if (ToLower(word) != "lookup_table") {
+    long long n;
+    if (ScanInt(word.c_str(), word.c_str() + word.size(), n) == NULL || n < 1 || n > 4)
+      return Fail("invalid number of components for " + name);
+    ncomp = (int) n;
+    if (!NextWord(word)) { return Fail("truncated scalars " + name); }
+  }
+  if (ToLower(word) == "lookup_table") {
+    if (!NextWord(word)) { return Fail("truncated scalars " + name); }
+  } else {
+    return Fail("missing lookup table for " + name);
+  }
+
+  vtkIdType nvalues = npoints * ncomp;
+  if (!wanted) {
+    for (vtkIdType i = 0; i < nvalues; i++) {
+      pos = SkipSpace(pos, end);
+      if (pos == end) { return Fail("truncated scalars " + name); }
+      while (pos < end && !IsSpace(*pos)) { ++pos; }
+    }
+    return true;
+  }
+
+  vtkSmartPointer<vtkDataArray> array;
+  bool ids = (name == "cell.id" || name == "cell.type");
+  if (ids || IsIntegerType(type)) {
+    // labels start in the narrowest type that usually holds them, other integer fields as int
+    int width = (name == "cell.type") ? 1 : (name == "cell.id") ? 4 : 0;
+    const char *start = pos;
+    array = ReadIntegers(npoints, ncomp, IsIntegerType(type), width);
+    if (array == NULL && IsIntegerType(type)) { return Fail("could not read values of " + name); }
+    // labels stored as fractions are read again below as they are
+    if (array == NULL) { pos = start; }
+  }
+  if (array == NULL && type == "float") {
+    vtkSmartPointer<vtkFloatArray> a = vtkSmartPointer<vtkFloatArray>::New();
+    a->SetNumberOfComponents(ncomp);
+    a->SetNumberOfTuples(npoints);
+    float *out = a->GetPointer(0);
+    const char *p = pos;
+    for (vtkIdType i = 0; i < nvalues; i++) {
+      double v;
+      p = ScanDouble(SkipSpace(p, end), end, v);
+      if (p == NULL) { return Fail("could not read values of " + name); }
+      out[i] = (float) v;
+    }
+    pos = p;
+    array = a;
+  } else if (array == NULL) {
+    vtkSmartPointer<vtkDoubleArray> a = vtkSmartPointer<vtkDoubleArray>::New();
+    a->SetNumberOfComponents(ncomp);
+    a->SetNumberOfTuples(npoints);
+    double *out = a->GetPointer(0);
+    const char *p = pos;
+    for (vtkIdType i = 0; i < nvalues; i++) {
+      p = ScanDouble(SkipSpace(p, end), end, out[i]);
+      if (p == NULL) { return Fail("could not read values of " + name); }
+    }
+    pos = p;
+    array = a;
+  }
+  array->SetName(name.c_str());
+  vtkPointData *pd = sp->GetPointData();
+  if (pd->GetScalars() == NULL)
+    pd->SetScalars(array);
+  else
+    pd->AddArray(array);
+  return true;
+}
@@ -0,0 +1,33 @@
+//
+// Fast parser for the legacy ascii STRUCTURED_POINTS files written by Morpheus' VtkPlotter
+//
+
+#ifndef VISGRID3D_LEGACYPARSER_H
+#define VISGRID3D_LEGACYPARSER_H
+
+#include <string>
+#include <vector>
+#include <vtkSmartPointer.h>
+#include <vtkStructuredPoints.h>
+#include <vtkDataArray.h>
+
+class LegacyParser {
+ public:
+  // Parse the '\0'-terminated buffer and store the requested scalars as point data of the returned
+  // structured points; cell.type is stored as unsigned char and cell.id as unsigned int when the values
+  // allow it, and as int otherwise. Returns NULL and sets
+  // error when the file uses a part of the legacy format that is not supported here.
+  vtkSmartPointer<vtkStructuredPoints> Parse(const char *buf, size_t len, std::vector<std::string> names);
+  std::string error;
+
+ private:
+  bool Fail(std::string msg);
+  bool NextWord(std::string &word);
+  bool NextLine();
+  vtkSmartPointer<vtkDataArray> ReadIntegers(vtkIdType npoints, int ncomp, bool integers, int width);
+  bool ReadScalars(vtkSmartPointer<vtkStructuredPoints> sp, vtkIdType npoints, std::string name, bool wanted);
+  const char *pos;
+  const char *end;
+};
+
+#endif //VISGRID3D_LEGACYPARSER_H
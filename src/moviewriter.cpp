@@ -0,0 +1,73 @@
+//
+// Streams rendered frames into a movie encoded by an ffmpeg process
+//
+
+#include "moviewriter.h"
+
+#include <iostream>
+#include <sstream>
+#include <vector>
+#include <csignal>
+#include <algorithm>
+
+MovieWriter::MovieWriter(std::string _fn, int _width, int _height, double fps) : queue(4) {
+  fn = _fn;
+  width = _width;
+  height = _height;
+  // quote the file name for the shell
+  std::string quoted = "'";
+  for (auto c : fn) { quoted += (c == '\'') ? std::string("'\\''") : std::string(1, c); }
+  quoted += "'";
+  std::stringstream cmd;
+  // yuv420p plays everywhere but needs even sizes
+  cmd << "ffmpeg -loglevel error -y -f rawvideo -pix_fmt rgb24 -s " << width << "x" << height << " -r " << fps
+      << " -i - -vf 'pad=ceil(iw/2)*2:ceil(ih/2)*2' -pix_fmt yuv420p " << quoted;
+  // a failing ffmpeg should end in an error message rather than a signal
+  signal(SIGPIPE, SIG_IGN);
+  pipe = popen(cmd.str().c_str(), "w");
+  if (pipe == NULL) {
+    std::cout << "Could not start ffmpeg to write " << fn << std::endl;
+    exit(0);
+  }
+  worker = std::thread(&MovieWriter::Work, this);
+}
+
+MovieWriter::~MovieWriter() {
+  queue.Close();
+  worker.join();
+  if (pclose(pipe) != 0)
+    std::cout << "ffmpeg could not write " << fn << std::endl;
+  else
+    std::cout << "Wrote movie " << fn << std::endl;
+}
+
+void MovieWriter::Write(vtkSmartPointer<vtkImageData> image) {
+  queue.Push(image);
+}
+
+void MovieWriter::Work() {
+  vtkSmartPointer<vtkImageData> image;
+  std::vector<char> frame(3 * (size_t) width * height);
+  bool failed = false;
+  while (queue.Pop(image)) {
+    if (failed)
+      continue;
+    int *dim = image->GetDimensions();
+    int ncomp = image->GetNumberOfScalarComponents();
+    const unsigned char *pixels = static_cast<unsigned char *>(image->GetScalarPointer());
+    // ffmpeg takes the top row first, images start at the bottom
+    std::fill(frame.begin(), frame.end(), 0);
+    for (int y = 0; y < std::min(height, dim[1]); y++) {
+      const unsigned char *p = pixels + (size_t) (dim[1] - 1 - y) * dim[0] * ncomp;
+      char *row = frame.data() + 3 * (size_t) y * width;
+      for (int x = 0; x < std::min(width, dim[0]); x++) {
+        for (int j = 0; j < 3; j++) { row[3 * x + j] = p[ncomp * x + std::min(j, ncomp - 1)]; }
+      }
+    }
+    image = NULL;
+    if (fwrite(frame.data(), 1, frame.size(), pipe) != frame.size()) {
+      std::cout << "Could not pass frames to ffmpeg for " << fn << std::endl;
+      failed = true;
+    }
+  }
+}
@@ -0,0 +1,34 @@
+//
+// Streams rendered frames into a movie encoded by an ffmpeg process
+//
+
+#ifndef VISGRID3D_MOVIEWRITER_H
+#define VISGRID3D_MOVIEWRITER_H
+
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vtkSmartPointer.h>
+#include <vtkImageData.h>
+
+#include "boundedqueue.h"
+
+class MovieWriter {
+ public:
+  // Start ffmpeg writing frames of width x height at fps to fn, in the format that goes with its extension
+  MovieWriter(std::string fn, int _width, int _height, double fps);
+  // Wait until every frame is passed on and ffmpeg has finished the movie
+  ~MovieWriter();
+  // Queue the next frame, waiting while the queue is full. Frames of another size are cropped or padded.
+  void Write(vtkSmartPointer<vtkImageData> image);
+
+ private:
+  void Work();
+  std::string fn;
+  FILE *pipe;
+  int width, height;
+  BoundedQueue<vtkSmartPointer<vtkImageData> > queue;
+  std::thread worker;
+};
+
+#endif //VISGRID3D_MOVIEWRITER_H
@@ -0,0 +1,56 @@
+//
+// Minimal helpers to spread loops over the grid across threads
+//
+
+#ifndef VISGRID3D_PARALLEL_H
+#define VISGRID3D_PARALLEL_H
+
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+// Number of threads to use when nthreads is not set (0) or invalid
+inline int GetNumberOfThreads(int nthreads) {
+  if (nthreads > 0)
+    return nthreads;
+  return (int) std::max(std::thread::hardware_concurrency(), 1u);
+}
+
+// Whether the calling thread was started by ParallelFor
+inline bool &InParallelFor() {
+  static thread_local bool inside = false;
+  return inside;
+}
+
+// Fewest voxels or faces worth a thread of their own, as starting and joining one costs more than a few thousand
+// of them take
+const long long voxel_grain = 4096;
+
+// Number of slabs ParallelFor uses for n items with nthreads threads and at least grain items per slab
+inline int GetNumberOfSlabs(long long n, int nthreads, long long grain = 1) {
+  return (int) std::max(1LL, std::min((long long) nthreads, n / std::max(grain, 1LL)));
+}
+
+// Split [0, n) into nslabs contiguous slabs of at least grain items and call fn(begin, end, slab) for each of
+// them on its own thread. Slabs are ordered, so results stored per slab can be concatenated in the serial order.
+// Loops nested in another ParallelFor run their slabs one after the other on the calling thread.
+template<class F>
+void ParallelFor(long long n, int nslabs, F fn, long long grain = 1) {
+  nslabs = GetNumberOfSlabs(n, nslabs, grain);
+  if (nslabs == 1 || InParallelFor()) {
+    for (int s = 0; s < nslabs; s++) { fn(n * s / nslabs, n * (s + 1) / nslabs, s); }
+    return;
+  }
+  std::vector<std::thread> threads;
+  for (int s = 0; s < nslabs; s++) {
+    long long begin = n * s / nslabs;
+    long long end = n * (s + 1) / nslabs;
+    threads.push_back(std::thread([=] {
+      InParallelFor() = true;
+      fn(begin, end, s);
+    }));
+  }
+  for (auto &t : threads) { t.join(); }
+}
+
+#endif //VISGRID3D_PARALLEL_H
@@ -0,0 +1,100 @@
+//
+// Reads upcoming time steps on worker threads while the current step is rendered
+//
+
+#include "prefetcher.h"
+
+#include <algorithm>
+
+Prefetcher::Prefetcher(DataReader *_reader, std::vector<int> _steps, int _depth, size_t _max_bytes) {
+  reader = _reader;
+  steps = _steps;
+  depth = std::max(_depth, 1);
+  max_bytes = _max_bytes;
+  ready_bytes = 0;
+  step_bytes = 0;
+  stop = false;
+  int nthreads = std::min(depth, (int) std::max(std::thread::hardware_concurrency(), 1u));
+  for (int i = 0; i < nthreads; i++)
+    workers.push_back(std::thread(&Prefetcher::Work, this));
+}
+
+Prefetcher::~Prefetcher() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stop = true;
+    queue.clear();
+  }
+  cv.notify_all();
+  for (auto &w : workers) { w.join(); }
+}
+
+bool Prefetcher::Take(int step, stepdata &sd) {
+  std::unique_lock<std::mutex> lock(mutex);
+  std::deque<int>::iterator it = std::find(queue.begin(), queue.end(), step);
+  if (it != queue.end()) {
+    // not started yet, the caller reads it right away
+    queue.erase(it);
+    return false;
+  }
+  cv.wait(lock, [&] { return inflight.find(step) == inflight.end(); });
+  std::map<int, stepdata>::iterator r = ready.find(step);
+  if (r == ready.end())
+    return false;
+  sd = r->second;
+  ready_bytes -= std::min(ready_bytes, StepBytes(sd));
+  ready.erase(r);
+  cv.notify_all();
+  return true;
+}
+
+void Prefetcher::Schedule(int step) {
+  std::vector<int>::iterator pos = std::find(steps.begin(), steps.end(), step);
+  if (pos == steps.end())
+    return;
+  std::vector<int> upcoming(pos + 1, pos + 1 + std::min<long>(depth, steps.end() - pos - 1));
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    // forget about steps that are no longer ahead of the current one
+    queue.clear();
+    for (std::map<int, stepdata>::iterator r = ready.begin(); r != ready.end();) {
+      if (std::find(upcoming.begin(), upcoming.end(), r->first) == upcoming.end()) {
+        ready_bytes -= std::min(ready_bytes, StepBytes(r->second));
+        r = ready.erase(r);
+      } else {
+        ++r;
+      }
+    }
+    for (auto s : upcoming) {
+      if (ready.find(s) == ready.end() && inflight.find(s) == inflight.end() && !reader->IsCached(s))
+        queue.push_back(s);
+    }
+  }
+  cv.notify_all();
+}
+
+void Prefetcher::Work() {
+  std::vector<char> buf;
+  std::unique_lock<std::mutex> lock(mutex);
+  while (true) {
+    // only start on a new step when it is expected to fit in memory
+    cv.wait(lock, [&] {
+      return stop || (!queue.empty() && ((ready.empty() && inflight.empty()) ||
+          ready_bytes + (inflight.size() + 1) * step_bytes <= max_bytes));
+    });
+    if (stop)
+      return;
+    int step = queue.front();
+    queue.pop_front();
+    inflight.insert(step);
+    lock.unlock();
+    stepdata sd = reader->ReadData(step, buf);
+    size_t bytes = StepBytes(sd);
+    lock.lock();
+    inflight.erase(step);
+    step_bytes = bytes;
+    ready[step] = sd;
+    ready_bytes += bytes;
+    cv.notify_all();
+  }
+}
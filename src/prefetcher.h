@@ -0,0 +1,46 @@
+//
+// Reads upcoming time steps on worker threads while the current step is rendered
+//
+
+#ifndef VISGRID3D_PREFETCHER_H
+#define VISGRID3D_PREFETCHER_H
+
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
+
+#include "datareader.h"
+
+class Prefetcher {
+ public:
+  // Keep up to depth steps following the last requested one (in the order of steps) in flight or ready,
+  // as long as the ready steps take less than max_bytes
+  Prefetcher(DataReader *_reader, std::vector<int> _steps, int _depth, size_t _max_bytes);
+  ~Prefetcher();
+  // Hand over a prefetched step, waiting for it if it is being read; returns false if it was not prefetched
+  bool Take(int step, stepdata &sd);
+  // Queue the steps that follow step
+  void Schedule(int step);
+
+ private:
+  void Work();
+  DataReader *reader;
+  std::vector<int> steps;
+  int depth;
+  size_t max_bytes;
+  size_t ready_bytes;
+  size_t step_bytes;  // size of the last step read, used to estimate the size of steps in flight
+  bool stop;
+  std::deque<int> queue;
+  std::set<int> inflight;
+  std::map<int, stepdata> ready;
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::vector<std::thread> workers;
+};
+
+#endif //VISGRID3D_PREFETCHER_H
@@ -0,0 +1,190 @@
+//
+// Software ray caster drawing voxel grids without OpenGL
+//
+
+#include "raycaster.h"
+#include "parallel.h"
+
+#include <cmath>
+#include <limits>
+
+namespace {
+
+void Normalize(double *v) {
+  double n = sqrt(v[0] * v[0] + v[1] * v[1] + v[2] * v[2]);
+  if (n > 0) {
+    for (int j = 0; j < 3; j++) { v[j] /= n; }
+  }
+}
+
+void Cross(const double *a, const double *b, double *c) {
+  c[0] = a[1] * b[2] - a[2] * b[1];
+  c[1] = a[2] * b[0] - a[0] * b[2];
+  c[2] = a[0] * b[1] - a[1] * b[0];
+}
+
+// Walk a ray from o along d through the grid voxel by voxel (Amanatides and Woo), compositing the voxels it
+// passes front to back. Adds the color to rgb, weighted by the opacity it still shows, and returns the opacity.
+// Voxels are lit by light, the cosine between the light and each axis, on the face the ray enters them by.
+double Trace(const unsigned char *rgba, const int *dim, const double *lo, const double *spacing, const double *o,
+             const double *d, const double *light, double *rgb) {
+  const double inf = std::numeric_limits<double>::infinity();
+  // clip the ray to the grid, remembering the axis of the face it enters by
+  double t0 = 0, t1 = inf;
+  int axis = (fabs(d[0]) > fabs(d[1])) ? (fabs(d[0]) > fabs(d[2]) ? 0 : 2) : (fabs(d[1]) > fabs(d[2]) ? 1 : 2);
+  for (int j = 0; j < 3; j++) {
+    double hi = lo[j] + dim[j] * spacing[j];
+    if (d[j] == 0) {
+      if (o[j] < lo[j] || o[j] > hi)
+        return 0;
+      continue;
+    }
+    double ta = (lo[j] - o[j]) / d[j], tb = (hi - o[j]) / d[j];
+    if (ta > tb)
+      std::swap(ta, tb);
+    if (ta > t0) {
+      t0 = ta;
+      axis = j;
+    }
+    t1 = std::min(t1, tb);
+  }
+  if (t0 >= t1)
+    return 0;
+  const long long stride[3] = {1, dim[0], (long long) dim[0] * dim[1]};
+  int idx[3], step[3];
+  double tmax[3], tdelta[3];
+  long long v = 0;
+  for (int j = 0; j < 3; j++) {
+    idx[j] = std::min(std::max((int) floor((o[j] + t0 * d[j] - lo[j]) / spacing[j]), 0), dim[j] - 1);
+    v += idx[j] * stride[j];
+    step[j] = (d[j] > 0) ? 1 : ((d[j] < 0) ? -1 : 0);
+    tmax[j] = (step[j] == 0) ? inf : (lo[j] + (idx[j] + (step[j] > 0)) * spacing[j] - o[j]) / d[j];
+    tdelta[j] = (step[j] == 0) ? inf : spacing[j] / fabs(d[j]);
+  }
+  double alpha = 0;
+  while (true) {
+    const unsigned char *c = rgba + 4 * v;
+    if (c[3] > 0) {
+      double w = (1 - alpha) * c[3] / 255.0;
+      double shade = w * light[axis] / 255.0;
+      for (int j = 0; j < 3; j++) { rgb[j] += shade * c[j]; }
+      alpha += w;
+      // nothing behind shows through anymore
+      if (alpha > 1 - 0.5 / 255)
+        break;
+    }
+    axis = (tmax[0] < tmax[1]) ? (tmax[0] < tmax[2] ? 0 : 2) : (tmax[1] < tmax[2] ? 1 : 2);
+    idx[axis] += step[axis];
+    if (idx[axis] < 0 || idx[axis] >= dim[axis])
+      break;
+    v += step[axis] * stride[axis];
+    tmax[axis] += tdelta[axis];
+  }
+  return alpha;
+}
+
+}
+
+
+RayCaster::RayCaster(int _width, int _height, color _bg, int _nthreads) {
+  width = _width;
+  height = _height;
+  bg = _bg;
+  nthreads = _nthreads;
+  position[0] = position[1] = 0;
+  position[2] = 1;
+  focus[0] = focus[1] = focus[2] = 0;
+  viewup[0] = viewup[2] = 0;
+  viewup[1] = 1;
+  viewangle = 30;
+}
+
+void RayCaster::Rotate(double *v, const double *axis, double angle) {
+  // Rodrigues' rotation, counterclockwise around the axis like vtkTransform::RotateWXYZ
+  double k[3] = {axis[0], axis[1], axis[2]};
+  Normalize(k);
+  double a = angle * M_PI / 180.0;
+  double kv[3];
+  Cross(k, v, kv);
+  double dot = k[0] * v[0] + k[1] * v[1] + k[2] * v[2];
+  for (int j = 0; j < 3; j++) { v[j] = v[j] * cos(a) + kv[j] * sin(a) + k[j] * dot * (1 - cos(a)); }
+}
+
+void RayCaster::ResetCamera(const double *bounds) {
+  double radius = 0;
+  for (int j = 0; j < 3; j++) {
+    double w = bounds[2 * j + 1] - bounds[2 * j];
+    radius += w * w;
+    focus[j] = 0.5 * (bounds[2 * j] + bounds[2 * j + 1]);
+  }
+  radius = (radius == 0) ? 1 : 0.5 * sqrt(radius);
+  double distance = radius / sin(viewangle * M_PI / 360.0);
+  position[0] = focus[0];
+  position[1] = focus[1];
+  position[2] = focus[2] + distance;
+  viewup[0] = viewup[2] = 0;
+  viewup[1] = 1;
+}
+
+void RayCaster::SetCamera(const double *_position, const double *_focus, double pitch, double roll,
+                          double azimuth) {
+  for (int j = 0; j < 3; j++) {
+    position[j] = _position[j];
+    focus[j] = _focus[j];
+    viewup[j] = (j == 1);
+  }
+  Turn(pitch, roll, azimuth);
+}
+
+void RayCaster::Turn(double pitch, double roll, double azimuth) {
+  double f[3], r[3], v[3];
+  // pitch turns the focal point around the camera, about the axis pointing to the right of the view
+  for (int j = 0; j < 3; j++) { f[j] = focus[j] - position[j]; }
+  Cross(f, viewup, r);
+  for (int j = 0; j < 3; j++) { v[j] = focus[j] - position[j]; }
+  Rotate(v, r, pitch);
+  for (int j = 0; j < 3; j++) { focus[j] = position[j] + v[j]; }
+  // roll turns the view up about the direction of projection
+  for (int j = 0; j < 3; j++) { f[j] = focus[j] - position[j]; }
+  Rotate(viewup, f, roll);
+  // azimuth turns the camera around the focal point, about the view up
+  for (int j = 0; j < 3; j++) { v[j] = position[j] - focus[j]; }
+  Rotate(v, viewup, azimuth);
+  for (int j = 0; j < 3; j++) { position[j] = focus[j] + v[j]; }
+}
+
+void RayCaster::Render(const unsigned char *rgba, const int *dim, const double *origin, const double *spacing,
+                       unsigned char *image) {
+  double f[3], r[3], u[3], lo[3], light[3];
+  for (int j = 0; j < 3; j++) { f[j] = focus[j] - position[j]; }
+  Normalize(f);
+  Cross(f, viewup, r);
+  Normalize(r);
+  Cross(r, f, u);
+  for (int j = 0; j < 3; j++) {
+    lo[j] = origin[j] - 0.5 * spacing[j];
+    // a headlight, lighting both sides of the faces
+    light[j] = fabs(f[j]);
+  }
+  double th = tan(viewangle * M_PI / 360.0);
+  double aspect = (double) width / height;
+  const double background[3] = {bg.r, bg.g, bg.b};
+  int nslabs = GetNumberOfSlabs(height, GetNumberOfThreads(nthreads));
+  ParallelFor(nslabs, nslabs, [&](long long s, long long, int) {
+    // rows are dealt out in turn, so no thread gets only the rows that miss the grid
+    for (int y = (int) s; y < height; y += nslabs) {
+      double sy = (2.0 * (y + 0.5) / height - 1.0) * th;
+      for (int x = 0; x < width; x++) {
+        double sx = (2.0 * (x + 0.5) / width - 1.0) * th * aspect;
+        double d[3], rgb[3] = {0, 0, 0};
+        for (int j = 0; j < 3; j++) { d[j] = f[j] + sx * r[j] + sy * u[j]; }
+        double alpha = Trace(rgba, dim, lo, spacing, position, d, light, rgb);
+        unsigned char *pixel = image + 3 * ((long long) y * width + x);
+        for (int j = 0; j < 3; j++) {
+          double c = rgb[j] + (1 - alpha) * background[j];
+          pixel[j] = static_cast<unsigned char>(std::min(std::max(c, 0.0), 1.0) * 255.0 + 0.5);
+        }
+      }
+    }
+  });
+}
@@ -0,0 +1,36 @@
+//
+// Software ray caster drawing voxel grids without OpenGL
+//
+
+#ifndef VISGRID3D_RAYCASTER_H
+#define VISGRID3D_RAYCASTER_H
+
+#include "colortable.h"
+
+class RayCaster {
+ public:
+  RayCaster(int _width, int _height, color _bg, int _nthreads);
+  // Point the camera at the center of the bounds from along +z, far enough to see all of them, like
+  // vtkRenderer::ResetCamera does for a new camera
+  void ResetCamera(const double *bounds);
+  // Place the camera like a vtkCamera at position looking at focus that is pitched, rolled and turned after
+  void SetCamera(const double *position, const double *focus, double pitch, double roll, double azimuth);
+  // Pitch, roll and turn the camera, in that order, like vtkCamera
+  void Turn(double pitch, double roll, double azimuth);
+  // Draw a grid of RGBA voxels (x fastest) into an RGB image with its first row at the bottom. Each voxel is
+  // a box of one spacing centered at origin + index * spacing, lit by a light at the camera.
+  void Render(const unsigned char *rgba, const int *dim, const double *origin, const double *spacing,
+              unsigned char *image);
+
+ private:
+  void Rotate(double *v, const double *axis, double angle);
+  int width, height;
+  color bg;
+  int nthreads;
+  double position[3];
+  double focus[3];
+  double viewup[3];
+  double viewangle;  // vertical view angle in degrees
+};
+
+#endif //VISGRID3D_RAYCASTER_H
@@ -0,0 +1,54 @@
+//
+// Memory-bounded least-recently-used cache of decoded time steps
+//
+
+#include "stepcache.h"
+
+#include <iostream>
+
+StepCache::StepCache(size_t _max_bytes) {
+  max_bytes = _max_bytes;
+  bytes = 0;
+  hits = 0;
+  misses = 0;
+}
+
+stepdata_ptr StepCache::Get(int step) {
+  std::lock_guard<std::mutex> lock(mutex);
+  std::map<int, std::list<entry>::iterator>::iterator it = index.find(step);
+  if (it == index.end()) {
+    misses++;
+    return NULL;
+  }
+  hits++;
+  lru.splice(lru.begin(), lru, it->second);
+  return it->second->data;
+}
+
+bool StepCache::Contains(int step) {
+  std::lock_guard<std::mutex> lock(mutex);
+  return index.find(step) != index.end();
+}
+
+void StepCache::Put(int step, stepdata_ptr sd) {
+  size_t size = StepBytes(*sd);
+  if (size > max_bytes)
+    return;
+  std::lock_guard<std::mutex> lock(mutex);
+  if (index.find(step) != index.end())
+    return;
+  lru.push_front({step, sd, size});
+  index[step] = lru.begin();
+  bytes += size;
+  while (bytes > max_bytes) {
+    bytes -= lru.back().bytes;
+    index.erase(lru.back().step);
+    lru.pop_back();
+  }
+}
+
+void StepCache::PrintStats() {
+  std::lock_guard<std::mutex> lock(mutex);
+  std::cout << "Step cache: " << hits << " hits, " << misses << " misses, " << lru.size() << " steps ("
+            << (bytes >> 20) << " MB) cached" << std::endl;
+}
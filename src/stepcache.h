@@ -0,0 +1,39 @@
+//
+// Memory-bounded least-recently-used cache of decoded time steps
+//
+
+#ifndef VISGRID3D_STEPCACHE_H
+#define VISGRID3D_STEPCACHE_H
+
+#include <list>
+#include <map>
+#include <mutex>
+
+#include "datareader.h"
+
+class StepCache {
+ public:
+  StepCache(size_t _max_bytes);
+  // Return the cached step or NULL, and count the hit or miss
+  stepdata_ptr Get(int step);
+  bool Contains(int step);
+  // Store a step, evicting the least recently used steps when the cache exceeds its budget
+  void Put(int step, stepdata_ptr sd);
+  void PrintStats();
+
+ private:
+  struct entry {
+    int step;
+    stepdata_ptr data;
+    size_t bytes;
+  };
+  std::list<entry> lru;  // most recently used first
+  std::map<int, std::list<entry>::iterator> index;
+  size_t bytes;
+  size_t max_bytes;
+  unsigned long hits;
+  unsigned long misses;
+  std::mutex mutex;
+};
+
+#endif //VISGRID3D_STEPCACHE_H
@@ -2,12 +2,20 @@
 // Created by mpalm on 15/03/17.
 //
 
-// TODO: Add support for drawing surfaces instead of voxels
 // TODO: Add support for drawing colored boundaries
 
 #include "visualizer.h"
+#include "parallel.h"
+#include "downsample.h"
+#include "raycaster.h"
+#include "boundedqueue.h"
+#include "framewriter.h"
+#include "moviewriter.h"
 #include <sstream>      // std::stringstream
 #include <algorithm>
+#include <set>
+#include <stdint.h>
+#include <thread>
 
 #include <vtkStructuredPoints.h>
 #include <vtkDataSetMapper.h>
@@ -20,12 +28,23 @@
 #include <vtkRendererCollection.h>
 #include <vtkCamera.h>
 #include <vtkWindowToImageFilter.h>
-#include <vtkPNGWriter.h>
 #include <vtkPointData.h>
+#include <vtkCellData.h>
+#include <vtkFloatArray.h>
+#include <vtkIdTypeArray.h>
+#include <vtkDiscreteMarchingCubes.h>
+#include <vtkWindowedSincPolyDataFilter.h>
+#include <vtkDecimatePro.h>
+#include <vtkPolyDataNormals.h>
+#include <vtkAppendPolyData.h>
+#include <vtkPiecewiseFunction.h>
+#include <vtkVolumeProperty.h>
+#include <vtkFixedPointVolumeRayCastMapper.h>
 #include <vtkLookupTable.h>
 #include <vtkCellArray.h>
 #include <vtkPolygon.h>
 #include <vtkPoints.h>
+#include <vtkType.h>
 
 // For compatibility with new VTK generic data arrays
 #ifdef vtkGenericDataArray_h
@@ -33,6 +52,402 @@
 #endif
 
 
+// Bucket of a label in a lookup table starting at label lo, or -1 if it is not one of the types. Only whole labels
+// match a type, as when the labels were compared with each type one at a time.
+template<class T>
+inline int GetBucket(T value, long long lo, const std::vector<int> &lut) {
+  double v = (double) value;
+  if (!(v >= lo && v < lo + (long long) lut.size()))
+    return -1;
+  long long label = (long long) value;
+  return ((double) label == v) ? lut[label - lo] : -1;
+}
+
+// Sort the voxels into the buckets of their types in one pass, reading the labels through their concrete type.
+// Each thread first counts the voxels per type in its slab of the grid, after which the buckets are allocated
+// once and every slab fills its own part of them.
+template<class T>
+void BucketVoxels(const T *labels, vtkIdType n, int lo, const std::vector<int> &lut,
+                  std::vector<std::vector<vtkIdType> > &buckets, int nthreads) {
+  const size_t nbuckets = buckets.size();
+  int nslabs = GetNumberOfSlabs(n, nthreads, voxel_grain);
+  std::vector<std::vector<vtkIdType> > offsets(nslabs);
+  ParallelFor(n, nslabs, [&](long long begin, long long end, int slab) {
+    std::vector<vtkIdType> counts(nbuckets, 0);
+    for (vtkIdType i = begin; i < end; i++) {
+      int b = GetBucket(labels[i], lo, lut);
+      if (b >= 0) { counts[b]++; }
+    }
+    offsets[slab] = counts;
+  });
+  for (size_t b = 0; b < nbuckets; b++) {
+    vtkIdType total = 0;
+    for (int slab = 0; slab < nslabs; slab++) {
+      vtkIdType count = offsets[slab][b];
+      offsets[slab][b] = total;
+      total += count;
+    }
+    buckets[b].resize(total);
+  }
+  ParallelFor(n, nslabs, [&](long long begin, long long end, int slab) {
+    std::vector<vtkIdType> next = offsets[slab];
+    for (vtkIdType i = begin; i < end; i++) {
+      int b = GetBucket(labels[i], lo, lut);
+      if (b >= 0) { buckets[b][next[b]++] = i; }
+    }
+  });
+}
+
+// Mark the bricks with voxels whose values differ between two steps. With spread, the bricks of their neighbours
+// are marked as well, since the faces and visibility of those voxels depend on them.
+template<class T>
+void DiffArrays(const T *a, const T *b, int ncomp, const int *dim, int bricksize, bool spread,
+                std::vector<char> &dirty, int nthreads) {
+  const int nb[3] = {(dim[0] + bricksize - 1) / bricksize, (dim[1] + bricksize - 1) / bricksize,
+                     (dim[2] + bricksize - 1) / bricksize};
+  int nslabs = GetNumberOfSlabs(dim[2], nthreads);
+  std::vector<std::vector<char> > marked(nslabs, std::vector<char>(dirty.size(), 0));
+  ParallelFor(dim[2], nslabs, [&](long long begin, long long end, int slab) {
+    std::vector<char> &m = marked[slab];
+    for (int z = (int) begin; z < end; z++) {
+      for (int y = 0; y < dim[1]; y++) {
+        vtkIdType row = ((vtkIdType) z * dim[1] + y) * dim[0];
+        for (int x = 0; x < dim[0]; x++) {
+          if (a[(row + x) * ncomp] == b[(row + x) * ncomp])
+            continue;
+          int r = spread ? 1 : 0;
+          for (int k = std::max(z - r, 0) / bricksize; k <= std::min(z + r, dim[2] - 1) / bricksize; k++) {
+            for (int j = std::max(y - r, 0) / bricksize; j <= std::min(y + r, dim[1] - 1) / bricksize; j++) {
+              for (int i = std::max(x - r, 0) / bricksize; i <= std::min(x + r, dim[0] - 1) / bricksize; i++) {
+                m[i + nb[0] * (j + (size_t) nb[1] * k)] = 1;
+              }
+            }
+          }
+        }
+      }
+    }
+  });
+  for (auto &m : marked) {
+    for (size_t i = 0; i < dirty.size(); i++) { dirty[i] |= m[i]; }
+  }
+}
+
+// Sort the voxels of the box from lo to hi (exclusive) into the buckets of their types
+template<class T>
+void BucketBrickVoxels(const T *labels, const int *dim, const int *lo, const int *hi, int minlabel,
+                       const std::vector<int> &lut, std::vector<std::vector<vtkIdType> > &buckets) {
+  for (int z = lo[2]; z < hi[2]; z++) {
+    for (int y = lo[1]; y < hi[1]; y++) {
+      vtkIdType row = ((vtkIdType) z * dim[1] + y) * dim[0];
+      for (vtkIdType i = row + lo[0]; i < row + hi[0]; i++) {
+        int b = GetBucket(labels[i], minlabel, lut);
+        if (b >= 0) { buckets[b].push_back(i); }
+      }
+    }
+  }
+}
+
+// Map the field values of the given voxels to rgb colors
+template<class T>
+void FillColors(const T *values, int ncomp, const std::vector<vtkIdType> &ids, int vmin, int vmax, ColorMap *cm,
+                const std::vector<unsigned char> &table, unsigned char *out, int nthreads) {
+  ParallelFor((long long) ids.size(), nthreads, [&](long long begin, long long end, int) {
+    for (long long k = begin; k < end; k++) {
+      int idx = cm->GetIndex((int) values[ids[k] * ncomp], vmin, vmax);
+      bool valid = idx >= 0 && idx < 256;
+      for (int j = 0; j < 3; j++) { out[3 * k + j] = valid ? table[3 * idx + j] : 0; }
+    }
+  }, voxel_grain);
+}
+
+// Neighbours across the six faces of a voxel, and the corners of those faces (in half voxels from its center),
+// ordered counterclockwise when seen from outside
+const int face_dirs[6][3] = {{-1, 0, 0}, {1, 0, 0}, {0, -1, 0}, {0, 1, 0}, {0, 0, -1}, {0, 0, 1}};
+const int face_corners[6][4][3] = {
+    {{-1, -1, -1}, {-1, -1, 1}, {-1, 1, 1}, {-1, 1, -1}},
+    {{1, -1, -1}, {1, 1, -1}, {1, 1, 1}, {1, -1, 1}},
+    {{-1, -1, -1}, {1, -1, -1}, {1, -1, 1}, {-1, -1, 1}},
+    {{-1, 1, -1}, {-1, 1, 1}, {1, 1, 1}, {1, 1, -1}},
+    {{-1, -1, -1}, {-1, 1, -1}, {1, 1, -1}, {1, -1, -1}},
+    {{-1, -1, 1}, {1, -1, 1}, {1, 1, 1}, {-1, 1, 1}}};
+
+// A rectangle of voxel faces pointing in direction f, covering size voxels from start (1 along the axis of f)
+struct quad {
+  int f;
+  int start[3];
+  int size[3];
+  unsigned char rgb[3];
+};
+
+// Mark the faces of each voxel that border a voxel of another type or the edge of the grid, one bit per face
+template<class T>
+void GetFaceMasks(const T *labels, const int *dim, const std::vector<vtkIdType> &ids,
+                  std::vector<unsigned char> &masks, int nthreads) {
+  const vtkIdType nx = dim[0];
+  const vtkIdType nxy = (vtkIdType) dim[0] * dim[1];
+  const vtkIdType stride[3] = {1, nx, nxy};
+  ParallelFor((long long) ids.size(), nthreads, [&](long long begin, long long end, int) {
+    for (long long k = begin; k < end; k++) {
+      vtkIdType i = ids[k];
+      vtkIdType pos[3] = {i % nx, (i / nx) % dim[1], i / nxy};
+      unsigned char mask = 0;
+      for (int f = 0; f < 6; f++) {
+        int axis = f / 2;
+        vtkIdType q = pos[axis] + face_dirs[f][axis];
+        if (q < 0 || q >= dim[axis] || labels[i + face_dirs[f][axis] * stride[axis]] != labels[i])
+          mask |= (unsigned char) (1 << f);
+      }
+      masks[k] = mask;
+    }
+  }, voxel_grain);
+}
+
+// Turn every exposed face into a quad of its own, counting them per slab so every slab knows where to put its own
+std::vector<quad> GetQuads(const std::vector<vtkIdType> &ids, const std::vector<unsigned char> &masks,
+                           const unsigned char *colors, const int *dim, int nthreads) {
+  int nslabs = GetNumberOfSlabs((long long) ids.size(), nthreads, voxel_grain);
+  std::vector<vtkIdType> first(nslabs + 1, 0);
+  ParallelFor((long long) ids.size(), nslabs, [&](long long begin, long long end, int slab) {
+    vtkIdType count = 0;
+    for (long long k = begin; k < end; k++) {
+      for (int f = 0; f < 6; f++) { count += (masks[k] >> f) & 1; }
+    }
+    first[slab + 1] = count;
+  });
+  for (int slab = 0; slab < nslabs; slab++) { first[slab + 1] += first[slab]; }
+  std::vector<quad> quads(first[nslabs]);
+  const vtkIdType nx = dim[0];
+  const vtkIdType nxy = (vtkIdType) dim[0] * dim[1];
+  ParallelFor((long long) ids.size(), nslabs, [&](long long begin, long long end, int slab) {
+    vtkIdType next = first[slab];
+    for (long long k = begin; k < end; k++) {
+      if (masks[k] == 0)
+        continue;
+      vtkIdType i = ids[k];
+      for (int f = 0; f < 6; f++) {
+        if (!((masks[k] >> f) & 1))
+          continue;
+        quad &q = quads[next++];
+        q.f = f;
+        q.start[0] = (int) (i % nx);
+        q.start[1] = (int) ((i / nx) % dim[1]);
+        q.start[2] = (int) (i / nxy);
+        q.size[0] = q.size[1] = q.size[2] = 1;
+        for (int j = 0; j < 3; j++) { q.rgb[j] = (colors == NULL) ? 0 : colors[3 * k + j]; }
+      }
+    }
+  });
+  return quads;
+}
+
+// Merge the exposed faces that point the same way into rectangles, slice by slice: every rectangle starts at
+// the first face not yet covered, grows along the row as far as the faces have the same color and then grows
+// row by row while the whole row matches
+std::vector<quad> MergeFaces(const std::vector<vtkIdType> &ids, const std::vector<unsigned char> &masks,
+                             const unsigned char *colors, const int *dim, int nthreads) {
+  const vtkIdType nx = dim[0];
+  const vtkIdType nxy = (vtkIdType) dim[0] * dim[1];
+  std::vector<quad> quads;
+  if (ids.empty())
+    return quads;
+  // only the bounding box of the voxels is meshed
+  vtkIdType lo[3] = {dim[0], dim[1], dim[2]}, hi[3] = {0, 0, 0};
+  for (auto i : ids) {
+    vtkIdType pos[3] = {i % nx, (i / nx) % dim[1], i / nxy};
+    for (int j = 0; j < 3; j++) {
+      lo[j] = std::min(lo[j], pos[j]);
+      hi[j] = std::max(hi[j], pos[j] + 1);
+    }
+  }
+  for (int f = 0; f < 6; f++) {
+    int a = f / 2, u = (a + 1) % 3, v = (a + 2) % 3;
+    // sort the faces by slice
+    const int nslices = (int) (hi[a] - lo[a]);
+    std::vector<vtkIdType> first(nslices + 1, 0);
+    std::vector<int> slice(ids.size());
+    for (size_t k = 0; k < ids.size(); k++) {
+      if (!((masks[k] >> f) & 1))
+        continue;
+      vtkIdType pos[3] = {ids[k] % nx, (ids[k] / nx) % dim[1], ids[k] / nxy};
+      slice[k] = (int) (pos[a] - lo[a]);
+      first[slice[k] + 1]++;
+    }
+    for (int s = 0; s < nslices; s++) { first[s + 1] += first[s]; }
+    std::vector<vtkIdType> order(first[nslices]);
+    std::vector<vtkIdType> next(first.begin(), first.end() - 1);
+    for (size_t k = 0; k < ids.size(); k++) {
+      if ((masks[k] >> f) & 1) { order[next[slice[k]]++] = (vtkIdType) k; }
+    }
+
+    int nslabs = GetNumberOfSlabs(nslices, nthreads);
+    std::vector<std::vector<quad> > slabquads(nslabs);
+    ParallelFor(nslices, nslabs, [&](long long begin, long long end, int slab) {
+      const int du = (int) (hi[u] - lo[u]), dv = (int) (hi[v] - lo[v]);
+      // color of the face at each position of the slice, -1 where there is none
+      std::vector<int> plane((size_t) du * dv, -1);
+      for (long long s = begin; s < end; s++) {
+        if (first[s] == first[s + 1])
+          continue;
+        for (vtkIdType o = first[s]; o < first[s + 1]; o++) {
+          vtkIdType k = order[o];
+          vtkIdType pos[3] = {ids[k] % nx, (ids[k] / nx) % dim[1], ids[k] / nxy};
+          const unsigned char *c = (colors == NULL) ? NULL : colors + 3 * k;
+          plane[(pos[u] - lo[u]) + (pos[v] - lo[v]) * du] = (c == NULL) ? 0 : (c[0] << 16) | (c[1] << 8) | c[2];
+        }
+        for (int y = 0; y < dv; y++) {
+          for (int x = 0; x < du;) {
+            int key = plane[x + (size_t) y * du];
+            if (key < 0) {
+              x++;
+              continue;
+            }
+            int w = 1;
+            while (x + w < du && plane[x + w + (size_t) y * du] == key) { w++; }
+            int h = 1;
+            while (y + h < dv) {
+              bool match = true;
+              for (int i = 0; i < w && match; i++) { match = plane[x + i + (size_t) (y + h) * du] == key; }
+              if (!match)
+                break;
+              h++;
+            }
+            for (int j = 0; j < h; j++) {
+              std::fill(plane.begin() + x + (size_t) (y + j) * du, plane.begin() + x + w + (size_t) (y + j) * du, -1);
+            }
+            quad q;
+            q.f = f;
+            q.start[a] = (int) (lo[a] + s);
+            q.start[u] = (int) lo[u] + x;
+            q.start[v] = (int) lo[v] + y;
+            q.size[a] = 1;
+            q.size[u] = w;
+            q.size[v] = h;
+            q.rgb[0] = (unsigned char) (key >> 16);
+            q.rgb[1] = (unsigned char) (key >> 8);
+            q.rgb[2] = (unsigned char) key;
+            slabquads[slab].push_back(q);
+            x += w;
+          }
+        }
+      }
+    });
+    for (auto &sq : slabquads) { quads.insert(quads.end(), sq.begin(), sq.end()); }
+  }
+  return quads;
+}
+
+// Position of a voxel computed from its index, instead of asking the structured points for it
+struct VoxelGrid {
+  VoxelGrid(vtkStructuredPoints *sp) {
+    int *dim = sp->GetDimensions();
+    double *o = sp->GetOrigin();
+    double *s = sp->GetSpacing();
+    for (int i = 0; i < 3; i++) {
+      origin[i] = o[i];
+      spacing[i] = s[i];
+    }
+    nx = dim[0];
+    nxy = (vtkIdType) dim[0] * dim[1];
+  }
+  void GetIndices(vtkIdType i, vtkIdType *pos) const {
+    pos[2] = i / nxy;
+    pos[1] = (i - pos[2] * nxy) / nx;
+    pos[0] = i - pos[2] * nxy - pos[1] * nx;
+  }
+  void GetPoint(vtkIdType i, float *p) const {
+    vtkIdType z = i / nxy;
+    vtkIdType r = i - z * nxy;
+    vtkIdType y = r / nx;
+    vtkIdType x = r - y * nx;
+    p[0] = (float) (origin[0] + spacing[0] * x);
+    p[1] = (float) (origin[1] + spacing[1] * y);
+    p[2] = (float) (origin[2] + spacing[2] * z);
+  }
+  double origin[3];
+  double spacing[3];
+  vtkIdType nx;
+  vtkIdType nxy;
+};
+
+// Copy the RGBA of the given voxels of an image into saved, or with restore, copy saved back into the image
+void CopyVoxels(unsigned char *rgba, const std::vector<vtkIdType> &ids, std::vector<unsigned char> &saved,
+                bool restore, int nthreads) {
+  saved.resize(4 * ids.size());
+  ParallelFor((long long) ids.size(), nthreads, [&](long long begin, long long end, int) {
+    for (long long k = begin; k < end; k++) {
+      unsigned char *voxel = rgba + 4 * ids[k];
+      if (restore)
+        std::copy(&saved[4 * k], &saved[4 * k] + 4, voxel);
+      else
+        std::copy(voxel, voxel + 4, &saved[4 * k]);
+    }
+  }, voxel_grain);
+}
+
+// Grow the box from lo to hi (exclusive) around the voxels of all types
+void GrowBox(const VoxelGrid &grid, const std::vector<std::vector<vtkIdType> > &voxels, vtkIdType *lo,
+             vtkIdType *hi) {
+  vtkIdType pos[3];
+  for (auto &ids : voxels) {
+    for (auto i : ids) {
+      grid.GetIndices(i, pos);
+      for (int j = 0; j < 3; j++) {
+        lo[j] = std::min(lo[j], pos[j]);
+        hi[j] = std::max(hi[j], pos[j] + 1);
+      }
+    }
+  }
+}
+
+// Surface around the given voxels from discrete marching cubes on a mask of their bounding box. The mask is
+// padded with a voxel on each side, so the surface is closed at the edges of the grid as well.
+vtkSmartPointer<vtkPolyData> GetSurfaceForVoxels(const VoxelGrid &grid, const std::vector<vtkIdType> &ids) {
+  if (ids.empty())
+    return vtkSmartPointer<vtkPolyData>::New();
+  vtkIdType lo[3], hi[3], pos[3];
+  grid.GetIndices(ids[0], lo);
+  grid.GetIndices(ids[0], hi);
+  for (auto i : ids) {
+    grid.GetIndices(i, pos);
+    for (int j = 0; j < 3; j++) {
+      lo[j] = std::min(lo[j], pos[j]);
+      hi[j] = std::max(hi[j], pos[j]);
+    }
+  }
+  int dim[3];
+  double origin[3];
+  for (int j = 0; j < 3; j++) {
+    dim[j] = (int) (hi[j] - lo[j] + 3);
+    origin[j] = grid.origin[j] + grid.spacing[j] * (lo[j] - 1);
+  }
+  vtkSmartPointer<vtkUnsignedCharArray> mask = vtkSmartPointer<vtkUnsignedCharArray>::New();
+  mask->SetNumberOfTuples((vtkIdType) dim[0] * dim[1] * dim[2]);
+  unsigned char *m = mask->GetPointer(0);
+  std::fill(m, m + (size_t) dim[0] * dim[1] * dim[2], 0);
+  for (auto i : ids) {
+    grid.GetIndices(i, pos);
+    m[(pos[0] - lo[0] + 1) + dim[0] * ((pos[1] - lo[1] + 1) + (vtkIdType) dim[1] * (pos[2] - lo[2] + 1))] = 1;
+  }
+  vtkSmartPointer<vtkStructuredPoints> image = vtkSmartPointer<vtkStructuredPoints>::New();
+  image->SetDimensions(dim);
+  image->SetOrigin(origin);
+  image->SetSpacing(grid.spacing[0], grid.spacing[1], grid.spacing[2]);
+  image->GetPointData()->SetScalars(mask);
+  vtkSmartPointer<vtkDiscreteMarchingCubes> cubes = vtkSmartPointer<vtkDiscreteMarchingCubes>::New();
+#if VTK_MAJOR_VERSION <= 5
+  cubes->SetInput(image);
+#else
+  cubes->SetInputData(image);
+#endif
+  cubes->SetValue(0, 1);
+  cubes->ComputeNormalsOff();
+  cubes->ComputeGradientsOff();
+  cubes->ComputeScalarsOff();
+  cubes->Update();
+  return cubes->GetOutput();
+}
+
+
 class vtkTimerCallback: public vtkCommand {
  private:
   int TimerCount;
@@ -43,59 +458,84 @@ class vtkTimerCallback: public vtkCommand {
   std::vector<double> opacity;
   std::vector<color> colors;
   std::vector<std::string> color_by;
-  std::vector<vtkSmartPointer<vtkActor> > update_actors;
-  std::map<int, std::vector<vtkSmartPointer<vtkActor> > > used_actors;
   std::vector<int> steps;
   std::vector<ColorMap *> cms;
   bool loop;
   int tmax;
   bool save;
+  bool paused;
+  vtkRenderWindowInteractor *interactor;
 
   static vtkTimerCallback *New() {
     vtkTimerCallback *cb = new vtkTimerCallback;
     cb->TimerCount = 0;
+    cb->paused = false;
     return cb;
   }
 
+  // Draw the step shown last again, at the given level of detail
+  void Redraw(bool lowres) {
+    if (TimerCount == 0)
+      return;
+    std::map<std::string, color> planes;
+    v->lowres = lowres;
+    v->VisualizeStep(steps[TimerCount - 1], taulist, false, colors, opacity, false, color_by, cms, planes, false, true);
+  }
+
   virtual void Execute(vtkObject *caller, unsigned long eventId, void *vtkNotUsed(callData)) {
+    if (eventId == vtkCommand::KeyPressEvent) {
+      std::string key = interactor->GetKeySym() == NULL ? "" : interactor->GetKeySym();
+      if (key.compare("space") != 0)
+        return;
+      paused = !paused;
+      std::cout << (paused ? "Paused" : "Playing") << std::endl;
+      // show the details of the step while paused
+      if (paused && v->lod > 1 && !save) {
+        Redraw(false);
+        interactor->GetRenderWindow()->Render();
+      }
+      return;
+    }
+    if (eventId != vtkCommand::TimerEvent) {
+      // moving the camera while paused shows the lower level of detail
+      if (!paused || v->lod <= 1 || save)
+        return;
+      bool press = eventId == vtkCommand::LeftButtonPressEvent || eventId == vtkCommand::MiddleButtonPressEvent
+          || eventId == vtkCommand::RightButtonPressEvent;
+      Redraw(press);
+      if (!press)
+        interactor->GetRenderWindow()->Render();
+      return;
+    }
+    if (paused)
+      return;
     vtkRenderWindowInteractor *iren = vtkRenderWindowInteractor::SafeDownCast(caller);
     if (this->TimerCount == tmax) {
-      if (this->loop)
+      if (this->loop) {
         this->TimerCount = 0;
-      else {
+        // the steps are saved in the first pass only, so the movie or images get every step once
+        this->save = false;
+      } else {
         iren->DestroyTimer();
         iren->GetRenderWindow()->Finalize();
 
         // Stop the interactor
         iren->TerminateApp();
         std::cout << "Closing window..." << std::endl;
+        return;
       }
     }
     vtkRenderWindow *win = iren->GetRenderWindow();
-    vtkRenderer *ren = win->GetRenderers()->GetFirstRenderer();
     std::map<std::string, color> planes;
-    for (auto actor : update_actors) { ren->RemoveActor(actor); }
-    if (used_actors.find(TimerCount) == used_actors.end()) {
-      update_actors = v->VisualizeStep(steps[TimerCount],
-                                       taulist,
-                                       false,
-                                       colors,
-                                       opacity,
-                                       save,
-                                       color_by,
-                                       cms, planes, false);
-      if (loop)
-        used_actors[steps[TimerCount]] = update_actors;
-    } else {
-      std::stringstream title;
-      title << "step " << steps[TimerCount];
-      win->SetWindowName(title.str().c_str());
-      for (auto actor : used_actors[steps[TimerCount]]) {
-        ren->AddActor(actor);
-      }
+    std::stringstream title;
+    title << "step " << steps[TimerCount];
+    win->SetWindowName(title.str().c_str());
+    // saved images are always drawn at full detail
+    v->lowres = v->lod > 1 && !save;
+    v->VisualizeStep(steps[TimerCount], taulist, false, colors, opacity, save, color_by, cms, planes, false, true);
+    // saving already rendered the step
+    if (!save)
       win->Render();
-      update_actors = used_actors[TimerCount];
-    }
     ++this->TimerCount;
   }
 
@@ -113,15 +553,40 @@ Visualizer::Visualizer(DataReader *_reader) {
   numlen = 6;
   prefix = "im";
   impath = "./";
+  nthreads = 0;
+  render = "glyph";
+  greedy = false;
+  surfaceby = "type";
+  smooth = 20;
+  decimate = 0;
+  cull = true;
+  incremental = false;
+  bricksize = 0;
+  lod = 1;
+  lowres = false;
+  backend = "vtk";
+  camplaced = false;
+  encoders = 2;
+  format = "png";
+  pnglevel = 5;
+  writer = NULL;
+}
+
+Visualizer::~Visualizer() {
+  // waits for the images that are still being written
+  delete writer;
+  for (auto &m : moviewriters) { delete m.second; }
 }
 
 void Visualizer::InitRenderer(bool onscreen) {
+  if (backend.compare("raycast") == 0)
+    return;  // images are drawn without a render window
   renderer = vtkSmartPointer<vtkRenderer>::New();
   renderWindow = vtkSmartPointer<vtkRenderWindow>::New();
   renderWindow->AddRenderer(renderer);
   renderer->SetBackground(bgcolor.r, bgcolor.g, bgcolor.b);
   renderWindow->SetSize(winsize[0], winsize[1]);
-  vtkSmartPointer<vtkCamera> cam = renderer->GetActiveCamera();
+  defaultcamera = renderer->GetActiveCamera();
   if (onscreen) {
     renderWindowInteractor = vtkSmartPointer<vtkRenderWindowInteractor>::New();
     renderWindowInteractor->SetRenderWindow(renderWindow);
@@ -132,6 +597,8 @@ void Visualizer::InitRenderer(bool onscreen) {
 }
 
 void Visualizer::ModifyCamera() {
+  if (backend.compare("raycast") == 0)
+    return;  // the ray caster reads the camera settings when it starts
   vtkSmartPointer<vtkCamera> cam = vtkSmartPointer<vtkCamera>::New();
   cam->SetPosition(camposition);
   cam->SetFocalPoint(camfocus);
@@ -143,6 +610,29 @@ void Visualizer::ModifyCamera() {
   renderer->SetActiveCamera(cam);
 }
 
+void Visualizer::SetView(const cameraview &view, const double *bounds) {
+  if (!view.custom) {
+    // start from the default camera fitted to the grid, which is then only turned
+    vtkSmartPointer<vtkCamera> cam = vtkSmartPointer<vtkCamera>::New();
+    cam->DeepCopy(defaultcamera);
+    renderer->SetActiveCamera(cam);
+    renderer->ResetCamera(bounds);
+    cam->Pitch(view.pitch);
+    cam->Roll(view.roll);
+    cam->Azimuth(view.azimuth);
+    renderer->ResetCameraClippingRange();
+    return;
+  }
+  for (int j = 0; j < 3; j++) {
+    camposition[j] = view.position[j];
+    camfocus[j] = view.focus[j];
+  }
+  campitch = view.pitch;
+  camroll = view.roll;
+  camazimuth = view.azimuth;
+  ModifyCamera();
+}
+
 vtkSmartPointer<vtkActor> Visualizer::GetPlane(std::vector<std::vector<int>> corners, color planecolor){
   vtkSmartPointer<vtkActor> actor = vtkSmartPointer<vtkActor>::New();
   if (corners.size() != 4){
@@ -179,7 +669,8 @@ vtkSmartPointer<vtkActor> Visualizer::GetPlane(std::vector<std::vector<int>> cor
   return actor;
 }
 
-std::vector< vtkSmartPointer<vtkActor> > Visualizer::GetBoundaryPlanes(stepdata data, std::map<std::string,color> planes){
+std::vector< vtkSmartPointer<vtkActor> > Visualizer::GetBoundaryPlanes(const stepdata &data,
+                                                                      std::map<std::string,color> planes){
   std::vector< vtkSmartPointer<vtkActor> > actors;
   int *dim = data.sp->GetDimensions();
   int w = dim[0];
@@ -202,7 +693,7 @@ std::vector< vtkSmartPointer<vtkActor> > Visualizer::GetBoundaryPlanes(stepdata
 }
 
 
-vtkSmartPointer<vtkActor> Visualizer::GetActorForBox(stepdata data) {
+vtkSmartPointer<vtkActor> Visualizer::GetActorForBox(const stepdata &data) {
   int *dim = data.sp->GetDimensions();
   vtkSmartPointer<vtkImageData> boxdata = vtkSmartPointer<vtkImageData>::New();
   boxdata->SetDimensions(2, 2, 2);
@@ -221,27 +712,119 @@ vtkSmartPointer<vtkActor> Visualizer::GetActorForBox(stepdata data) {
   return actor;
 }
 
-vtkSmartPointer<vtkPoints> Visualizer::GetPointsForTau(stepdata data, int tau) {
-  vtkSmartPointer<vtkPoints> points = vtkSmartPointer<vtkPoints>::New();
-  for (int i = 0; i < (int) data.sp->GetNumberOfPoints(); i++) {
-    double p[3];
-    data.sp->GetPoint(i, p);
-    if (data.tau->GetComponent(i, 0) == tau) { points->InsertNextPoint(p); }
+std::vector<std::vector<vtkIdType> > Visualizer::GetVoxelsForTypes(const stepdata &data, std::vector<int> taulist) {
+  std::vector<std::vector<vtkIdType> > buckets(taulist.size());
+  if (taulist.empty())
+    return buckets;
+  // map each label to its bucket, so all types are collected in a single pass over the grid
+  int lo = *std::min_element(taulist.begin(), taulist.end());
+  int hi = *std::max_element(taulist.begin(), taulist.end());
+  std::vector<int> lut((size_t) hi - lo + 1, -1);
+  for (int i = (int) taulist.size() - 1; i >= 0; i--) { lut[taulist[i] - lo] = i; }
+  vtkIdType n = data.tau->GetNumberOfTuples();
+  switch (data.tau->GetDataType()) {
+    vtkTemplateMacro(BucketVoxels(static_cast<VTK_TT *>(data.tau->GetVoidPointer(0)), n, lo, lut, buckets,
+                                  GetNumberOfThreads(nthreads)));
+    default:
+      for (vtkIdType i = 0; i < n; i++) {
+        double label = data.tau->GetComponent(i, 0) - lo;
+        if (label >= 0 && label < lut.size() && lut[(size_t) label] >= 0) { buckets[lut[(size_t) label]].push_back(i); }
+      }
+  }
+  // types that are listed more than once share their voxels
+  for (size_t i = 0; i < taulist.size(); i++) {
+    if (lut[taulist[i] - lo] != (int) i)
+      buckets[i] = buckets[lut[taulist[i] - lo]];
   }
-  return points;
+  return buckets;
 }
 
-std::pair<vtkSmartPointer<vtkPoints>, vtkSmartPointer<vtkUnsignedCharArray>>
-Visualizer::GetPointsAndColorsForTau(stepdata data, int tau, std::string color_by, ColorMap *cm) {
-  vtkSmartPointer<vtkPoints> points = vtkSmartPointer<vtkPoints>::New();
-  vtkSmartPointer<vtkDataArray> v = data.extra_fields[color_by];
+std::vector<vtkIdType> Visualizer::CullHiddenVoxels(const stepdata &data, const std::vector<vtkIdType> &ids) {
+  int *dim = data.sp->GetDimensions();
+  const vtkIdType nx = dim[0], ny = dim[1], nz = dim[2];
+  const vtkIdType nwords = (nx + 63) / 64;
+  const vtkIdType nrows = ny * nz;
+  int threads = GetNumberOfThreads(nthreads);
+  if ((vtkIdType) ids.size() * 64 < nx * ny * nz) {
+    // for a small part of the grid, such as a brick, comparing the labels of the neighbours is cheaper
+    std::vector<unsigned char> masks(ids.size(), 63);
+    switch (data.tau->GetDataType()) {
+      vtkTemplateMacro(GetFaceMasks(static_cast<VTK_TT *>(data.tau->GetVoidPointer(0)), dim, ids, masks, threads));
+    }
+    std::vector<vtkIdType> shown;
+    for (size_t k = 0; k < ids.size(); k++) {
+      if (masks[k] != 0)
+        shown.push_back(ids[k]);
+    }
+    return shown;
+  }
+  // occupancy of the grid, a bit per voxel with each row of x padded to whole words
+  std::vector<uint64_t> occupied((size_t) (nrows * nwords), 0);
+  for (auto i : ids) {
+    vtkIdType row = i / nx;
+    vtkIdType x = i - row * nx;
+    occupied[row * nwords + x / 64] |= (uint64_t) 1 << (x % 64);
+  }
+  // a voxel is hidden when it has occupied neighbours on all six sides, so voxels on the edge of the grid never are
+  std::vector<uint64_t> hidden((size_t) (nrows * nwords), 0);
+  ParallelFor(nrows, threads, [&](long long begin, long long end, int) {
+    for (vtkIdType row = begin; row < end; row++) {
+      vtkIdType y = row % ny, z = row / ny;
+      if (y == 0 || y == ny - 1 || z == 0 || z == nz - 1)
+        continue;
+      const uint64_t *c = &occupied[row * nwords];
+      const uint64_t *ym = c - nwords, *yp = c + nwords, *zm = c - ny * nwords, *zp = c + ny * nwords;
+      for (vtkIdType w = 0; w < nwords; w++) {
+        uint64_t left = (c[w] << 1) | (w > 0 ? c[w - 1] >> 63 : 0);
+        uint64_t right = (c[w] >> 1) | (w + 1 < nwords ? c[w + 1] << 63 : 0);
+        hidden[row * nwords + w] = c[w] & left & right & ym[w] & yp[w] & zm[w] & zp[w];
+      }
+    }
+  });
+  // keep the visible voxels in their original order
+  int nslabs = GetNumberOfSlabs((long long) ids.size(), threads, voxel_grain);
+  std::vector<vtkIdType> first(nslabs + 1, 0);
+  auto visible = [&](vtkIdType i) {
+    vtkIdType row = i / nx;
+    vtkIdType x = i - row * nx;
+    return !((hidden[row * nwords + x / 64] >> (x % 64)) & 1);
+  };
+  ParallelFor((long long) ids.size(), nslabs, [&](long long begin, long long end, int slab) {
+    vtkIdType count = 0;
+    for (long long k = begin; k < end; k++) { count += visible(ids[k]); }
+    first[slab + 1] = count;
+  });
+  for (int slab = 0; slab < nslabs; slab++) { first[slab + 1] += first[slab]; }
+  std::vector<vtkIdType> shown(first[nslabs]);
+  ParallelFor((long long) ids.size(), nslabs, [&](long long begin, long long end, int slab) {
+    vtkIdType next = first[slab];
+    for (long long k = begin; k < end; k++) {
+      if (visible(ids[k]))
+        shown[next++] = ids[k];
+    }
+  });
+  return shown;
+}
+
+void Visualizer::GetPointsForTau(const stepdata &data, const std::vector<vtkIdType> &ids, vtkPoints *points) {
+  points->SetNumberOfPoints((vtkIdType) ids.size());
+  float *p = static_cast<float *>(points->GetData()->GetVoidPointer(0));
+  VoxelGrid grid(data.sp);
+  ParallelFor((long long) ids.size(), GetNumberOfThreads(nthreads), [&](long long begin, long long end, int) {
+    for (long long k = begin; k < end; k++) { grid.GetPoint(ids[k], p + 3 * k); }
+  }, voxel_grain);
+  points->Modified();
+}
+
+void Visualizer::GetColorsForTau(const stepdata &data, const std::vector<vtkIdType> &ids, std::string color_by,
+                                 ColorMap *cm, vtkUnsignedCharArray *colors) {
+  vtkSmartPointer<vtkDataArray> v = data.extra_fields.at(color_by);
 //  double color[3];
 
-  color c;
   // Set up character array that holds the colors for each voxel
-  vtkSmartPointer<vtkUnsignedCharArray> colors = vtkSmartPointer<vtkUnsignedCharArray>::New();
   colors->SetName("colors");
   colors->SetNumberOfComponents(3);
+  colors->SetNumberOfTuples((vtkIdType) ids.size());
 
   // Create lookup table for colors
   vtkSmartPointer<vtkLookupTable> lut = vtkSmartPointer<vtkLookupTable>::New();
@@ -249,68 +832,617 @@ Visualizer::GetPointsAndColorsForTau(stepdata data, int tau, std::string color_b
 //  lut->SetTableRange(range[0], range[1]);
 //  lut->Build();
 
-  // get points and set colors
-  for (int i = 0; i < (int) data.sp->GetNumberOfPoints(); i++) {
-    double p[3];
-    data.sp->GetPoint(i, p);
-    if (data.tau->GetComponent(i, 0) == tau) {
-      points->InsertNextPoint(p);
-      c = cm->GetColor(v->GetComponent(i, 0),range[0],range[1]);
-//      lut->GetColor(v->GetComponent(i, 0), color);
-      unsigned char ccolor[3] = {static_cast<unsigned char>(255.0*c.r),
-                   static_cast<unsigned char>(255.0*c.g),
-                   static_cast<unsigned char>(255.0*c.b)};
-      colors->InsertNextTupleValue(ccolor);
-    }
+  // set colors, looking them up in a table so the colormap is only read from the threads
+  std::vector<unsigned char> table(3 * 256);
+  for (int idx = 0; idx < 256; idx++) {
+    color c = cm->GetColorForIndex(idx);
+    table[3 * idx] = static_cast<unsigned char>(255.0 * c.r);
+    table[3 * idx + 1] = static_cast<unsigned char>(255.0 * c.g);
+    table[3 * idx + 2] = static_cast<unsigned char>(255.0 * c.b);
   }
-  return {points, colors};
+  unsigned char *out = colors->GetPointer(0);
+  int ncomp = v->GetNumberOfComponents();
+  switch (v->GetDataType()) {
+    vtkTemplateMacro(FillColors(static_cast<VTK_TT *>(v->GetVoidPointer(0)), ncomp, ids, (int) range[0],
+                                (int) range[1], cm, table, out, GetNumberOfThreads(nthreads)));
+    default:
+      for (size_t k = 0; k < ids.size(); k++) {
+        color c = cm->GetColor(v->GetComponent(ids[k], 0), range[0], range[1]);
+        out[3 * k] = static_cast<unsigned char>(255.0 * c.r);
+        out[3 * k + 1] = static_cast<unsigned char>(255.0 * c.g);
+        out[3 * k + 2] = static_cast<unsigned char>(255.0 * c.b);
+      }
+  }
+  colors->Modified();
 }
 
+vtkSmartPointer<vtkPolyData>
+Visualizer::GetFacesForType(const stepdata &data, const std::vector<vtkIdType> &ids, std::string color_by,
+                            ColorMap *cm) {
+  int threads = GetNumberOfThreads(nthreads);
+  std::vector<unsigned char> masks(ids.size(), 0);
+  int *dim = data.sp->GetDimensions();
+  switch (data.tau->GetDataType()) {
+    vtkTemplateMacro(GetFaceMasks(static_cast<VTK_TT *>(data.tau->GetVoidPointer(0)), dim, ids, masks, threads));
+  }
+  vtkSmartPointer<vtkUnsignedCharArray> colors;
+  if (color_by.compare("none") != 0) {
+    colors = vtkSmartPointer<vtkUnsignedCharArray>::New();
+    GetColorsForTau(data, ids, color_by, cm, colors);
+  }
+  const unsigned char *vc = (colors == NULL) ? NULL : colors->GetPointer(0);
+  std::vector<quad> quads = greedy ? MergeFaces(ids, masks, vc, dim, threads) : GetQuads(ids, masks, vc, dim, threads);
+  vtkIdType nquads = (vtkIdType) quads.size();
+
+  vtkSmartPointer<vtkPoints> points = vtkSmartPointer<vtkPoints>::New();
+  points->SetNumberOfPoints(4 * nquads);
+  float *p = static_cast<float *>(points->GetData()->GetVoidPointer(0));
+  vtkSmartPointer<vtkFloatArray> normals = vtkSmartPointer<vtkFloatArray>::New();
+  normals->SetName("normals");
+  normals->SetNumberOfComponents(3);
+  normals->SetNumberOfTuples(4 * nquads);
+  float *n = normals->GetPointer(0);
+  vtkSmartPointer<vtkIdTypeArray> connectivity = vtkSmartPointer<vtkIdTypeArray>::New();
+  connectivity->SetNumberOfValues(5 * nquads);
+  vtkIdType *conn = connectivity->GetPointer(0);
+  vtkSmartPointer<vtkUnsignedCharArray> quadcolors;
+  if (colors != NULL) {
+    quadcolors = vtkSmartPointer<vtkUnsignedCharArray>::New();
+    quadcolors->SetName("colors");
+    quadcolors->SetNumberOfComponents(3);
+    quadcolors->SetNumberOfTuples(nquads);
+  }
+  unsigned char *qc = (quadcolors == NULL) ? NULL : quadcolors->GetPointer(0);
 
-vtkSmartPointer<vtkActor>
-Visualizer::GetActorForType(stepdata data, int tau, color c, double opacity, std::string color_by, ColorMap *cm) {
+  VoxelGrid grid(data.sp);
+  ParallelFor(nquads, threads, [&](long long begin, long long end, int) {
+    for (long long k = begin; k < end; k++) {
+      const quad &q = quads[k];
+      conn[5 * k] = 4;
+      for (int c = 0; c < 4; c++) {
+        vtkIdType pt = 4 * k + c;
+        for (int j = 0; j < 3; j++) {
+          // corners lie half a voxel before the first or after the last voxel of the quad
+          double x = (face_corners[q.f][c][j] < 0) ? q.start[j] - 0.5 : q.start[j] + q.size[j] - 0.5;
+          p[3 * pt + j] = (float) (grid.origin[j] + grid.spacing[j] * x);
+          n[3 * pt + j] = (float) face_dirs[q.f][j];
+        }
+        conn[5 * k + 1 + c] = pt;
+      }
+      if (qc != NULL) {
+        for (int j = 0; j < 3; j++) { qc[3 * k + j] = q.rgb[j]; }
+      }
+    }
+  }, voxel_grain);
+
+  vtkSmartPointer<vtkCellArray> polys = vtkSmartPointer<vtkCellArray>::New();
+  polys->SetCells(nquads, connectivity);
   vtkSmartPointer<vtkPolyData> polydata = vtkSmartPointer<vtkPolyData>::New();
-  vtkSmartPointer<vtkPoints> points;
-  vtkSmartPointer<vtkUnsignedCharArray> colors;
-  if (color_by.compare("none") == 0) {
-    points = GetPointsForTau(data, tau);
-    polydata->SetPoints(points);
+  polydata->SetPoints(points);
+  polydata->SetPolys(polys);
+  polydata->GetPointData()->SetNormals(normals);
+  if (quadcolors != NULL)
+    polydata->GetCellData()->SetScalars(quadcolors);
+  return polydata;
+}
+
+vtkSmartPointer<vtkPolyData>
+Visualizer::GetSurfaceForType(const stepdata &data, const std::vector<vtkIdType> &ids, std::string color_by,
+                              ColorMap *cm) {
+  VoxelGrid grid(data.sp);
+  vtkSmartPointer<vtkPolyData> surface;
+  if (surfaceby.compare("cell") != 0 && color_by.compare("none") == 0) {
+    surface = GetSurfaceForVoxels(grid, ids);
   } else {
-    std::pair<vtkSmartPointer<vtkPoints>, vtkSmartPointer<vtkUnsignedCharArray>>
-        p = GetPointsAndColorsForTau(data, tau, color_by, cm);
-    points = p.first;
-    colors = p.second;
-    polydata->SetPoints(points);
-    polydata->GetPointData()->SetScalars(colors);
-  }
-//  vtkSmartPointer<vtkPolyData> glyph = vtkSmartPointer<vtkPolyData>::New();
-  vtkSmartPointer<vtkCubeSource> cubeSource = vtkSmartPointer<vtkCubeSource>::New();
-  vtkSmartPointer<vtkGlyph3D> glyph3D = vtkSmartPointer<vtkGlyph3D>::New();
-  glyph3D->SetColorModeToColorByScalar();
-  glyph3D->SetSourceConnection(cubeSource->GetOutputPort());
+    // a surface per cell, colored like the first voxel of the cell
+    std::vector<std::pair<long long, vtkIdType> > labels(ids.size());
+    for (size_t k = 0; k < ids.size(); k++) { labels[k] = {(long long) data.sigma->GetTuple1(ids[k]), (vtkIdType) k}; }
+    std::sort(labels.begin(), labels.end());
+    std::vector<size_t> first;
+    for (size_t k = 0; k < labels.size(); k++) {
+      if (k == 0 || labels[k].first != labels[k - 1].first)
+        first.push_back(k);
+    }
+    first.push_back(labels.size());
+    vtkSmartPointer<vtkUnsignedCharArray> colors;
+    if (color_by.compare("none") != 0) {
+      colors = vtkSmartPointer<vtkUnsignedCharArray>::New();
+      GetColorsForTau(data, ids, color_by, cm, colors);
+    }
+    const unsigned char *vc = (colors == NULL) ? NULL : colors->GetPointer(0);
+    long long ncells = (long long) first.size() - 1;
+    std::vector<vtkSmartPointer<vtkPolyData> > surfaces(ncells);
+    ParallelFor(ncells, GetNumberOfThreads(nthreads), [&](long long begin, long long end, int) {
+      for (long long c = begin; c < end; c++) {
+        std::vector<vtkIdType> cellids;
+        for (size_t k = first[c]; k < first[c + 1]; k++) { cellids.push_back(ids[labels[k].second]); }
+        surfaces[c] = GetSurfaceForVoxels(grid, cellids);
+        if (vc == NULL)
+          continue;
+        const unsigned char *rgb = vc + 3 * labels[first[c]].second;
+        vtkSmartPointer<vtkUnsignedCharArray> pointcolors = vtkSmartPointer<vtkUnsignedCharArray>::New();
+        pointcolors->SetName("colors");
+        pointcolors->SetNumberOfComponents(3);
+        pointcolors->SetNumberOfTuples(surfaces[c]->GetNumberOfPoints());
+        unsigned char *pc = pointcolors->GetPointer(0);
+        for (vtkIdType p = 0; p < surfaces[c]->GetNumberOfPoints(); p++) {
+          for (int j = 0; j < 3; j++) { pc[3 * p + j] = rgb[j]; }
+        }
+        surfaces[c]->GetPointData()->SetScalars(pointcolors);
+      }
+    });
+    if (surfaces.empty())
+      return vtkSmartPointer<vtkPolyData>::New();
+    vtkSmartPointer<vtkAppendPolyData> append = vtkSmartPointer<vtkAppendPolyData>::New();
+    for (auto cellsurface : surfaces) {
 #if VTK_MAJOR_VERSION <= 5
-  glyph3D->SetInput(polydata);
+      append->AddInput(cellsurface);
 #else
-  glyph3D->SetInputData(polydata);
+      append->AddInputData(cellsurface);
 #endif
-  glyph3D->ScalingOff();
-  glyph3D->Update();
-  vtkSmartPointer<vtkPolyDataMapper> mapper = vtkSmartPointer<vtkPolyDataMapper>::New();
-  mapper->SetInputConnection(glyph3D->GetOutputPort());
-  vtkSmartPointer<vtkActor> actor = vtkSmartPointer<vtkActor>::New();
-  actor->SetMapper(mapper);
+    }
+    append->Update();
+    surface = append->GetOutput();
+  }
+  if (surface->GetNumberOfPoints() == 0)
+    return surface;
+
+  if (smooth > 0) {
+    vtkSmartPointer<vtkWindowedSincPolyDataFilter> smoother = vtkSmartPointer<vtkWindowedSincPolyDataFilter>::New();
+#if VTK_MAJOR_VERSION <= 5
+    smoother->SetInput(surface);
+#else
+    smoother->SetInputData(surface);
+#endif
+    smoother->SetNumberOfIterations(smooth);
+    smoother->SetPassBand(0.1);
+    smoother->BoundarySmoothingOff();
+    smoother->FeatureEdgeSmoothingOff();
+    smoother->NonManifoldSmoothingOn();
+    smoother->NormalizeCoordinatesOn();
+    smoother->Update();
+    surface = smoother->GetOutput();
+  }
+  if (decimate > 0) {
+    vtkSmartPointer<vtkDecimatePro> decimator = vtkSmartPointer<vtkDecimatePro>::New();
+#if VTK_MAJOR_VERSION <= 5
+    decimator->SetInput(surface);
+#else
+    decimator->SetInputData(surface);
+#endif
+    decimator->SetTargetReduction(decimate);
+    decimator->PreserveTopologyOn();
+    decimator->Update();
+    surface = decimator->GetOutput();
+  }
+  vtkSmartPointer<vtkPolyDataNormals> normals = vtkSmartPointer<vtkPolyDataNormals>::New();
+#if VTK_MAJOR_VERSION <= 5
+  normals->SetInput(surface);
+#else
+  normals->SetInputData(surface);
+#endif
+  normals->SplittingOff();
+  normals->Update();
+  return normals->GetOutput();
+}
+
+typepipeline Visualizer::NewPipeline() {
+  typepipeline p;
+  p.cube = vtkSmartPointer<vtkCubeSource>::New();
+  p.points = vtkSmartPointer<vtkPoints>::New();
+  p.colors = vtkSmartPointer<vtkUnsignedCharArray>::New();
+  p.polydata = vtkSmartPointer<vtkPolyData>::New();
+  p.polydata->SetPoints(p.points);
+  p.mapper = vtkSmartPointer<vtkPolyDataMapper>::New();
+  if (render.compare("glyph") == 0) {
+    p.glyph = vtkSmartPointer<vtkGlyph3D>::New();
+    p.glyph->SetColorModeToColorByScalar();
+    p.glyph->SetSourceConnection(p.cube->GetOutputPort());
+#if VTK_MAJOR_VERSION <= 5
+    p.glyph->SetInput(p.polydata);
+#else
+    p.glyph->SetInputData(p.polydata);
+#endif
+    p.glyph->ScalingOff();
+    p.mapper->SetInputConnection(p.glyph->GetOutputPort());
+  }
+  p.actor = vtkSmartPointer<vtkActor>::New();
+  p.actor->SetMapper(p.mapper);
+  return p;
+}
+
+void Visualizer::UpdatePipeline(typepipeline &p, const stepdata &data, const std::vector<vtkIdType> &ids, color c,
+                                double opacity, std::string color_by, ColorMap *cm) {
   if (color_by.compare("none") == 0) {
-    actor->GetProperty()->SetOpacity(opacity);
-    actor->GetProperty()->SetColor(c.r, c.g, c.b);
+    p.actor->GetProperty()->SetOpacity(opacity);
+    p.actor->GetProperty()->SetColor(c.r, c.g, c.b);
+  }
+  if (render.compare("faces") == 0 || render.compare("surface") == 0) {
+    vtkSmartPointer<vtkPolyData> polydata = (render.compare("faces") == 0) ? GetFacesForType(data, ids, color_by, cm)
+                                                                           : GetSurfaceForType(data, ids, color_by, cm);
+#if VTK_MAJOR_VERSION <= 5
+    p.mapper->SetInput(polydata);
+#else
+    p.mapper->SetInputData(polydata);
+#endif
+    return;
+  }
+  // voxels enclosed by voxels of the same opaque type can not be seen (opacity is not used when coloring by a field)
+  bool hide = cull && (color_by.compare("none") != 0 || opacity >= 1);
+  std::vector<vtkIdType> visible;
+  if (hide)
+    visible = CullHiddenVoxels(data, ids);
+  const std::vector<vtkIdType> &shown = hide ? visible : ids;
+  // cubes fill the voxels, which are larger at a lower level of detail
+  double *spacing = data.sp->GetSpacing();
+  p.cube->SetXLength(spacing[0]);
+  p.cube->SetYLength(spacing[1]);
+  p.cube->SetZLength(spacing[2]);
+  // refill the buffers of the pipeline, which keep their memory when the number of voxels shrinks
+  GetPointsForTau(data, shown, p.points);
+  if (color_by.compare("none") == 0) {
+    p.polydata->GetPointData()->SetScalars(NULL);
+  } else {
+    GetColorsForTau(data, shown, color_by, cm, p.colors);
+    p.polydata->GetPointData()->SetScalars(p.colors);
+  }
+  p.polydata->Modified();
+}
+
+vtkSmartPointer<vtkActor>
+Visualizer::GetActorForType(const stepdata &data, const std::vector<vtkIdType> &ids, color c, double opacity,
+                            std::string color_by, ColorMap *cm) {
+  typepipeline p = NewPipeline();
+  UpdatePipeline(p, data, ids, c, opacity, color_by, cm);
+  return p.actor;
+}
+
+void Visualizer::ShowPipelines(pipelineset &set, bool visible) {
+  for (auto &type : set.pipelines) {
+    for (auto &p : type) {
+      if (p.actor != NULL)
+        p.actor->SetVisibility(visible);
+    }
+  }
+  if (set.volume != NULL)
+    set.volume->SetVisibility(visible);
+}
+
+void Visualizer::UpdateVolume(pipelineset &set, const stepdata &data, std::vector<int> taulist,
+                              std::vector<color> tau_colors, std::vector<double> tau_opacity,
+                              std::vector<std::string> color_by, std::vector<ColorMap *> cms) {
+  if (set.volume == NULL) {
+    set.image = vtkSmartPointer<vtkImageData>::New();
+    set.rgba = vtkSmartPointer<vtkUnsignedCharArray>::New();
+    set.rgba->SetName("rgba");
+    set.rgba->SetNumberOfComponents(4);
+    // the image holds colors with their opacity, which maps linearly to the opacity of the volume
+    vtkSmartPointer<vtkPiecewiseFunction> opacity = vtkSmartPointer<vtkPiecewiseFunction>::New();
+    opacity->AddPoint(0, 0);
+    opacity->AddPoint(255, 1);
+    vtkSmartPointer<vtkVolumeProperty> property = vtkSmartPointer<vtkVolumeProperty>::New();
+    property->SetIndependentComponents(0);
+    property->SetScalarOpacity(opacity);
+    property->SetInterpolationTypeToNearest();
+    property->ShadeOff();
+    vtkSmartPointer<vtkFixedPointVolumeRayCastMapper> mapper = vtkSmartPointer<vtkFixedPointVolumeRayCastMapper>::New();
+#if VTK_MAJOR_VERSION <= 5
+    mapper->SetInput(set.image);
+#else
+    mapper->SetInputData(set.image);
+#endif
+    mapper->SetNumberOfThreads(GetNumberOfThreads(nthreads));
+    double *spacing = data.sp->GetSpacing();
+    mapper->SetSampleDistance(0.5 * std::min(spacing[0], std::min(spacing[1], spacing[2])));
+    set.volume = vtkSmartPointer<vtkVolume>::New();
+    set.volume->SetMapper(mapper);
+    set.volume->SetProperty(property);
+    set.added.push_back(set.volume);
+  }
+  std::vector<std::vector<vtkIdType> > voxels = GetVoxelsForTypes(data, taulist);
+  // the image only covers the voxels of the types and the static types under them, with a transparent voxel
+  // around them. The image points are at the voxel centres, so without it nearest sampling stops halfway through
+  // the outer voxels and a type one voxel thick gives an image without thickness.
+  VoxelGrid grid(data.sp);
+  int *dim = data.sp->GetDimensions();
+  vtkIdType lo[3] = {dim[0], dim[1], dim[2]}, hi[3] = {0, 0, 0};
+  GrowBox(grid, voxels, lo, hi);
+  if (!set.background.empty()) {
+    for (int j = 0; j < 3; j++) {
+      lo[j] = std::min(lo[j], set.backlo[j]);
+      hi[j] = std::max(hi[j], set.backlo[j] + set.backsize[j]);
+    }
+  }
+  bool empty = lo[0] >= hi[0];
+  for (int j = 0; j < 3; j++) {
+    lo[j] = empty ? 0 : lo[j] - 1;
+    hi[j] = empty ? 1 : hi[j] + 1;
+  }
+  int size[3];
+  double origin[3];
+  for (int j = 0; j < 3; j++) {
+    size[j] = (int) (hi[j] - lo[j]);
+    origin[j] = grid.origin[j] + grid.spacing[j] * lo[j];
+  }
+  vtkIdType n = (vtkIdType) size[0] * size[1] * size[2];
+  set.rgba->SetNumberOfTuples(n);
+  unsigned char *rgba = set.rgba->GetPointer(0);
+  std::fill(rgba, rgba + 4 * n, 0);
+  // the static types are copied in first and the animated types are drawn over them
+  for (int z = 0; z < set.backsize[2]; z++) {
+    for (int y = 0; y < set.backsize[1]; y++) {
+      const unsigned char *row = set.background.data() + 4 * set.backsize[0] * (y + (vtkIdType) set.backsize[1] * z);
+      vtkIdType offset = (set.backlo[0] - lo[0]) + size[0] * ((set.backlo[1] - lo[1] + y) +
+          (vtkIdType) size[1] * (set.backlo[2] - lo[2] + z));
+      std::copy(row, row + 4 * set.backsize[0], rgba + 4 * offset);
+    }
+  }
+  FillRGBA(data, voxels, tau_colors, tau_opacity, color_by, cms, lo, size, rgba);
+  set.rgba->Modified();
+  set.image->SetDimensions(size);
+  set.image->SetOrigin(origin);
+  set.image->SetSpacing(grid.spacing[0], grid.spacing[1], grid.spacing[2]);
+  set.image->GetPointData()->SetScalars(set.rgba);
+  set.image->Modified();
+}
+
+void Visualizer::FillBackground(pipelineset &set, const stepdata &data, std::vector<int> static_tau,
+                                std::vector<color> tau_colors, std::vector<double> tau_opacity,
+                                std::vector<std::string> color_by, std::vector<ColorMap *> cms) {
+  std::vector<std::vector<vtkIdType> > voxels = GetVoxelsForTypes(data, static_tau);
+  VoxelGrid grid(data.sp);
+  int *dim = data.sp->GetDimensions();
+  vtkIdType hi[3] = {0, 0, 0};
+  for (int j = 0; j < 3; j++) { set.backlo[j] = dim[j]; }
+  GrowBox(grid, voxels, set.backlo, hi);
+  set.background.clear();
+  if (set.backlo[0] >= hi[0]) {
+    set.backsize[0] = set.backsize[1] = set.backsize[2] = 0;
+    return;
+  }
+  for (int j = 0; j < 3; j++) { set.backsize[j] = (int) (hi[j] - set.backlo[j]); }
+  set.background.assign(4 * (size_t) set.backsize[0] * set.backsize[1] * set.backsize[2], 0);
+  FillRGBA(data, voxels, tau_colors, tau_opacity, color_by, cms, set.backlo, set.backsize, set.background.data());
+}
+
+void Visualizer::FillRGBA(const stepdata &data, const std::vector<std::vector<vtkIdType> > &voxels,
+                          std::vector<color> tau_colors, std::vector<double> tau_opacity,
+                          std::vector<std::string> color_by, std::vector<ColorMap *> cms, const vtkIdType *lo,
+                          const int *size, unsigned char *rgba) {
+  VoxelGrid grid(data.sp);
+  for (size_t i = 0; i < voxels.size(); i++) {
+    const std::vector<vtkIdType> &ids = voxels[i];
+    vtkSmartPointer<vtkUnsignedCharArray> colors;
+    if (color_by[i].compare("none") != 0) {
+      colors = vtkSmartPointer<vtkUnsignedCharArray>::New();
+      GetColorsForTau(data, ids, color_by[i], cms[i], colors);
+    }
+    const unsigned char *vc = (colors == NULL) ? NULL : colors->GetPointer(0);
+    unsigned char c[4] = {static_cast<unsigned char>(255.0 * tau_colors[i].r),
+                          static_cast<unsigned char>(255.0 * tau_colors[i].g),
+                          static_cast<unsigned char>(255.0 * tau_colors[i].b),
+                          static_cast<unsigned char>(255.0 * std::max(0.0, std::min(tau_opacity[i], 1.0)))};
+    ParallelFor((long long) ids.size(), GetNumberOfThreads(nthreads), [&](long long begin, long long end, int) {
+      vtkIdType p[3];
+      for (long long k = begin; k < end; k++) {
+        grid.GetIndices(ids[k], p);
+        vtkIdType offset = (p[0] - lo[0]) + size[0] * ((p[1] - lo[1]) + (vtkIdType) size[1] * (p[2] - lo[2]));
+        unsigned char *target = rgba + 4 * offset;
+        for (int j = 0; j < 3; j++) { target[j] = (vc == NULL) ? c[j] : vc[3 * k + j]; }
+        target[3] = c[3];
+      }
+    }, voxel_grain);
+  }
+}
+
+void Visualizer::UpdateBricks(stepdata_ptr dataptr, pipelineset &set, bool diff,
+                              std::vector<int> taulist, std::vector<color> tau_colors, std::vector<double> tau_opacity,
+                              std::vector<std::string> color_by, std::vector<ColorMap *> cms) {
+  const stepdata &data = *dataptr;
+  int *dim = data.sp->GetDimensions();
+  int nb[3];
+  for (int j = 0; j < 3; j++) { nb[j] = (dim[j] + bricksize - 1) / bricksize; }
+  size_t nbricks = (size_t) nb[0] * nb[1] * nb[2];
+  int threads = GetNumberOfThreads(nthreads);
+  std::vector<std::vector<typepipeline> > &bricks = set.pipelines;
+  const stepdata *prev = diff ? set.previous.get() : NULL;
+  bool all = prev == NULL || bricks.size() != taulist.size() || (!bricks.empty() && bricks[0].size() != nbricks)
+      || prev->tau->GetDataType() != data.tau->GetDataType();
+  if (bricks.size() != taulist.size() || (!bricks.empty() && bricks[0].size() != nbricks)) {
+    for (auto &type : bricks) {
+      for (auto &p : type) {
+        if (p.actor != NULL)
+          set.removed.push_back(p.actor);
+      }
+    }
+    bricks.assign(taulist.size(), std::vector<typepipeline>(nbricks));
+  }
+
+  // find the bricks that changed since the previous step
+  std::vector<char> dirty(nbricks, 0);
+  if (!all) {
+    switch (data.tau->GetDataType()) {
+      vtkTemplateMacro(DiffArrays(static_cast<VTK_TT *>(data.tau->GetVoidPointer(0)),
+                                  static_cast<VTK_TT *>(prev->tau->GetVoidPointer(0)), 1, dim, bricksize, true,
+                                  dirty, threads));
+      default:
+        all = true;
+    }
+  }
+  std::set<std::string> fields(color_by.begin(), color_by.end());
+  fields.erase("none");
+  for (auto f : fields) {
+    vtkSmartPointer<vtkDataArray> a = data.extra_fields.at(f);
+    // the range is computed here as well, before the threads need it
+    double *range = a->GetRange();
+    if (all)
+      continue;
+    std::map<std::string, vtkSmartPointer<vtkDataArray> >::const_iterator b = prev->extra_fields.find(f);
+    if (b == prev->extra_fields.end() || b->second->GetDataType() != a->GetDataType()
+        || b->second->GetNumberOfComponents() != a->GetNumberOfComponents()) {
+      all = true;
+      continue;
+    }
+    // the colors of all voxels change with the range of the field
+    double *prevrange = b->second->GetRange();
+    if (prevrange[0] != range[0] || prevrange[1] != range[1]) {
+      all = true;
+      continue;
+    }
+    switch (a->GetDataType()) {
+      vtkTemplateMacro(DiffArrays(static_cast<VTK_TT *>(a->GetVoidPointer(0)),
+                                  static_cast<VTK_TT *>(b->second->GetVoidPointer(0)), a->GetNumberOfComponents(),
+                                  dim, bricksize, false, dirty, threads));
+      default:
+        all = true;
+    }
+  }
+  std::vector<size_t> todo;
+  for (size_t b = 0; b < nbricks; b++) {
+    if (all || dirty[b])
+      todo.push_back(b);
+  }
+
+  // collect the voxels of each type in the changed bricks
+  std::vector<std::vector<std::vector<vtkIdType> > > voxels(todo.size());
+  if (!taulist.empty()) {
+    int minlabel = *std::min_element(taulist.begin(), taulist.end());
+    int maxlabel = *std::max_element(taulist.begin(), taulist.end());
+    std::vector<int> lut((size_t) maxlabel - minlabel + 1, -1);
+    for (int i = (int) taulist.size() - 1; i >= 0; i--) { lut[taulist[i] - minlabel] = i; }
+    ParallelFor((long long) todo.size(), threads, [&](long long begin, long long end, int) {
+      for (long long t = begin; t < end; t++) {
+        int pos[3] = {(int) (todo[t] % nb[0]), (int) ((todo[t] / nb[0]) % nb[1]), (int) (todo[t] / nb[0] / nb[1])};
+        int lo[3], hi[3];
+        for (int j = 0; j < 3; j++) {
+          lo[j] = pos[j] * bricksize;
+          hi[j] = std::min(lo[j] + bricksize, dim[j]);
+        }
+        voxels[t].resize(taulist.size());
+        switch (data.tau->GetDataType()) {
+          vtkTemplateMacro(BucketBrickVoxels(static_cast<VTK_TT *>(data.tau->GetVoidPointer(0)), dim, lo, hi,
+                                             minlabel, lut, voxels[t]));
+        }
+        for (size_t i = 0; i < taulist.size(); i++) {
+          if (lut[taulist[i] - minlabel] != (int) i)
+            voxels[t][i] = voxels[t][lut[taulist[i] - minlabel]];
+        }
+      }
+    });
+  }
+
+  // pipelines for bricks that get their first voxels are made up front, so the threads only fill them
+  for (size_t t = 0; t < todo.size(); t++) {
+    for (size_t i = 0; i < taulist.size(); i++) {
+      typepipeline &p = bricks[i][todo[t]];
+      if (p.actor == NULL && !voxels[t][i].empty()) {
+        p = NewPipeline();
+        set.added.push_back(p.actor);
+      }
+    }
+  }
+  ParallelFor((long long) todo.size(), threads, [&](long long begin, long long end, int) {
+    for (long long t = begin; t < end; t++) {
+      for (size_t i = 0; i < taulist.size(); i++) {
+        typepipeline &p = bricks[i][todo[t]];
+        if (p.actor != NULL)
+          UpdatePipeline(p, data, voxels[t][i], tau_colors[i], tau_opacity[i], color_by[i], cms[i]);
+      }
+      voxels[t].clear();
+    }
+  });
+  if (diff)
+    set.previous = dataptr;
+}
+
+void Visualizer::FillPipelines(stepdata_ptr dataptr, pipelineset &set, bool diff, std::vector<int> taulist,
+                               std::vector<color> tau_colors, std::vector<double> tau_opacity,
+                               std::vector<std::string> color_by, std::vector<ColorMap *> cms) {
+  if (render.compare("volume") == 0) {
+    UpdateVolume(set, *dataptr, taulist, tau_colors, tau_opacity, color_by, cms);
+    return;
+  }
+  if (bricksize > 0) {
+    // every brick of the grid gets its own actor, so bricks outside the view are culled by the renderer
+    UpdateBricks(dataptr, set, diff, taulist, tau_colors, tau_opacity, color_by, cms);
+  } else {
+    // the pipelines of animated types are built once and get the data of each new step
+    const stepdata &data = *dataptr;
+    std::vector<std::vector<vtkIdType> > voxels = GetVoxelsForTypes(data, taulist);
+    for (int i = 0; i < taulist.size(); i++) {
+      if (i == set.pipelines.size()) {
+        set.pipelines.push_back(std::vector<typepipeline>(1, NewPipeline()));
+        set.added.push_back(set.pipelines[i][0].actor);
+      }
+      UpdatePipeline(set.pipelines[i][0], data, voxels[i], tau_colors[i], tau_opacity[i], color_by[i], cms[i]);
+    }
+  }
+  // build the glyphs here rather than when the set is rendered
+  for (auto &type : set.pipelines) {
+    for (auto &p : type) {
+      if (p.glyph != NULL)
+        p.glyph->Update();
+    }
   }
-  return actor;
 }
 
-std::string Visualizer::GetImNameForStep(int step) {
+void Visualizer::AttachPipelines(pipelineset &set) {
+  for (auto &prop : set.removed) { renderer->RemoveViewProp(prop); }
+  for (auto &prop : set.added) { renderer->AddViewProp(prop); }
+  set.removed.clear();
+  set.added.clear();
+}
+
+void Visualizer::GetGridBounds(const stepdata &data, double *bounds) {
+  int *dim = data.sp->GetDimensions();
+  double *origin = data.sp->GetOrigin();
+  double *spacing = data.sp->GetSpacing();
+  for (int j = 0; j < 3; j++) {
+    bounds[2 * j] = origin[j] - 0.5 * spacing[j];
+    bounds[2 * j + 1] = origin[j] + (dim[j] - 0.5) * spacing[j];
+  }
+}
+
+std::string Visualizer::GetImNameForStep(int step, std::string view) {
   std::stringstream num;
   num << std::setfill('0') << std::setw(numlen);
   num << step;
-  return impath + prefix + "_" + num.str() + ".png";
+  std::string ext = (format.compare("raw") == 0) ? "rgb" : format;
+  return impath + prefix + (view.empty() ? "" : "_" + view) + "_" + num.str() + "." + ext;
+}
+
+FrameWriter *Visualizer::GetFrameWriter() {
+  if (writer == NULL)
+    writer = new FrameWriter(encoders, 2 * (size_t) encoders, format, pnglevel);
+  return writer;
+}
+
+void Visualizer::SaveFrame(int step, vtkSmartPointer<vtkImageData> image, std::string view) {
+  if (movie.empty()) {
+    GetFrameWriter()->Write(GetImNameForStep(step, view), image);
+    std::cout << "Create new image: " << GetImNameForStep(step, view).c_str() << std::endl;
+    return;
+  }
+  // every view gets its own movie, named like run_view.mp4
+  std::string fn = movie;
+  std::string tag = movietag + (view.empty() ? "" : "_" + view);
+  size_t ext = fn.rfind('.');
+  fn.insert((ext == std::string::npos || ext < fn.rfind('/') + 1) ? fn.size() : ext, tag);
+  MovieWriter *&moviewriter = moviewriters[view];
+  if (moviewriter == NULL)
+    moviewriter = new MovieWriter(fn, winsize[0], winsize[1], fps);
+  moviewriter->Write(image);
+  std::cout << "Add step " << step << " to " << fn << std::endl;
+}
+
+vtkSmartPointer<vtkImageData> Visualizer::GrabWindow() {
+  vtkSmartPointer<vtkWindowToImageFilter> windowToImageFilter = vtkSmartPointer<vtkWindowToImageFilter>::New();
+  windowToImageFilter->SetInput(renderWindow);
+  windowToImageFilter->Update();
+  // the filter reuses its output, the encoders get a copy
+  vtkSmartPointer<vtkImageData> image = vtkSmartPointer<vtkImageData>::New();
+  image->DeepCopy(windowToImageFilter->GetOutput());
+  return image;
 }
 
 
@@ -322,25 +1454,56 @@ std::vector<vtkSmartPointer<vtkActor> > Visualizer::VisualizeStep(int step,
                                                                   bool save,
                                                                   std::vector<std::string> color_by,
                                                                   std::vector<ColorMap *> cms,
-                                                                  std::map<std::string,color> planes,bool bbox) {
-  stepdata data = reader->GetDataForStep(step);
+                                                                  std::map<std::string,color> planes,bool bbox,
+                                                                  bool persistent) {
   std::vector<vtkSmartPointer<vtkActor> > actors;
+  pipelineset local;
+  pipelineset &set = !persistent ? local : (lowres ? coarse : full);
+  if (persistent) {
+    ShowPipelines(lowres ? full : coarse, false);
+    ShowPipelines(lowres ? fullstatic : coarsestatic, false);
+    ShowPipelines(set, true);
+    ShowPipelines(lowres ? coarsestatic : fullstatic, true);
+  }
+  // switching between levels of detail finds the other level up to date when the step did not change
+  bool current = persistent && set.step == step;
+  stepdata_ptr dataptr;
+  if (bbox || planes.size() > 0 || !current)
+    dataptr = reader->GetDataForStep(step);
   if (bbox)
-    renderer->AddActor(GetActorForBox(data));
+    renderer->AddActor(GetActorForBox(*dataptr));
   if (planes.size() > 0){
-    std::vector<vtkSmartPointer<vtkActor> > bnd_actors  = GetBoundaryPlanes(data, planes);
+    std::vector<vtkSmartPointer<vtkActor> > bnd_actors  = GetBoundaryPlanes(*dataptr, planes);
     for (auto plane : bnd_actors){
       renderer->AddActor(plane);
       actors.push_back(plane);
     }
   }
-  for (int i = 0; i < taulist.size(); i++) {
-    vtkSmartPointer<vtkActor> actor =
-        GetActorForType(data, taulist[i], tau_colors[i], tau_opacity[i], color_by[i], cms[i]);
-    renderer->AddActor(actor);
-    actors.push_back(actor);
+  if (!current && persistent && lowres && lod > 1)
+    dataptr = Downsample(*dataptr, lod, GetNumberOfThreads(nthreads));
+  if (current || (!persistent && taulist.empty())) {
+    // nothing to extract
+  } else if (persistent || render.compare("volume") == 0 || bricksize > 0) {
+    FillPipelines(dataptr, set, persistent && incremental, taulist, tau_colors, tau_opacity, color_by, cms);
+    AttachPipelines(set);
+  } else {
+    const stepdata &data = *dataptr;
+    std::vector<std::vector<vtkIdType> > voxels = GetVoxelsForTypes(data, taulist);
+    for (int i = 0; i < taulist.size(); i++) {
+      vtkSmartPointer<vtkActor> actor =
+          GetActorForType(data, voxels[i], tau_colors[i], tau_opacity[i], color_by[i], cms[i]);
+      renderer->AddActor(actor);
+      actors.push_back(actor);
+    }
+  }
+  if (persistent)
+    set.step = step;
+  for (auto &type : set.pipelines) {
+    for (auto &p : type) {
+      if (p.actor != NULL)
+        actors.push_back(p.actor);
+    }
   }
-
 
 //  renderWindow->Render();
   if (show) {
@@ -351,16 +1514,7 @@ std::vector<vtkSmartPointer<vtkActor> > Visualizer::VisualizeStep(int step,
     renderWindowInteractor->Start();
   }
   if (save) {
-    vtkSmartPointer<vtkWindowToImageFilter> windowToImageFilter = vtkSmartPointer<vtkWindowToImageFilter>::New();
-    windowToImageFilter->SetInput(renderWindow);
-    windowToImageFilter->Update();
-    vtkSmartPointer<vtkPNGWriter> writer =
-        vtkSmartPointer<vtkPNGWriter>::New();
-    writer->SetFileName(GetImNameForStep(step).c_str());
-    writer->SetInputConnection(windowToImageFilter->GetOutputPort());
-    writer->Write();
-    if (!show)
-      std::cout << "Create new image: " << GetImNameForStep(step).c_str() << std::endl;
+    SaveFrame(step, GrabWindow());
   }
   return actors;
 }
@@ -374,12 +1528,117 @@ void Visualizer::AnimateOffScreen(std::vector<int> taulist,
                          std::vector<std::string> color_by,
                          std::vector<ColorMap *> cms, std::map<std::string,color> planes) {
   std::cout << "Running visualization off screen!\n";
-  VisualizeStep(steps[0],static_tau, false, colors, opacity,false, color_by, cms, planes, true);
-  std::vector<vtkSmartPointer<vtkActor> > update_actors;
-  planes.clear();
-  for (auto step : steps){
-    for (auto actor : update_actors) { renderer->RemoveActor(actor); }
-    update_actors = VisualizeStep(step,taulist, false, colors, opacity, true, color_by, cms, planes, false);
+  if (backend.compare("raycast") == 0) {
+    RayCastOffScreen(taulist, steps, static_tau, colors, opacity, color_by, cms);
+    return;
+  }
+  // Steps pass through three stages at once: a worker reads each step and fills one of a few sets of pipelines
+  // with it, this thread renders the sets in order, and a pool of threads writes the images. The queues
+  // between the stages are bounded, so no stage runs more than a few steps ahead.
+  const int depth = 2;
+  std::vector<pipelineset> sets(depth);
+  if (render.compare("volume") == 0) {
+    // vtk draws volumes over each other rather than mixing their samples, so the static types go into the volume
+    // of every set, under the animated types
+    VisualizeStep(steps[0], std::vector<int>(), false, colors, opacity, false, color_by, cms, planes, true, false);
+    stepdata_ptr first = reader->GetDataForStep(steps[0]);
+    for (auto &set : sets) { FillBackground(set, *first, static_tau, colors, opacity, color_by, cms); }
+  } else {
+    VisualizeStep(steps[0],static_tau, false, colors, opacity,false, color_by, cms, planes, true, false);
+  }
+  double bounds[6];
+  if (!views.empty())
+    GetGridBounds(*reader->GetDataForStep(steps[0]), bounds);
+  BoundedQueue<int> idle(depth), ready(depth);
+  for (int i = 0; i < depth; i++) { idle.Push(i); }
+  std::thread extractor([&] {
+    int slot;
+    for (auto step : steps) {
+      idle.Pop(slot);
+      // the renderer is not touched here, the new actors are added to it when the set is rendered
+      FillPipelines(reader->GetDataForStep(step), sets[slot], incremental, taulist, colors, opacity, color_by, cms);
+      sets[slot].step = step;
+      ready.Push(slot);
+    }
+    ready.Close();
+  });
+  int slot;
+  while (ready.Pop(slot)) {
+    pipelineset &set = sets[slot];
+    AttachPipelines(set);
+    ShowPipelines(set, true);
+    // the step is rendered from every view before the worker gets the set back
+    std::vector<vtkSmartPointer<vtkImageData> > images;
+    for (size_t v = 0; v < std::max<size_t>(views.size(), 1); v++) {
+      if (!views.empty())
+        SetView(views[v], bounds);
+      images.push_back(GrabWindow());
+    }
+    // only the sets waiting to be rendered are hidden, so the worker can fill this one again
+    ShowPipelines(set, false);
+    idle.Push(slot);
+    for (size_t v = 0; v < images.size(); v++) { SaveFrame(set.step, images[v], views.empty() ? "" : views[v].name); }
+  }
+  extractor.join();
+}
+
+void Visualizer::RayCastOffScreen(std::vector<int> taulist, std::vector<int> steps, std::vector<int> static_tau,
+                                  std::vector<color> colors, std::vector<double> opacity,
+                                  std::vector<std::string> color_by, std::vector<ColorMap *> cms) {
+  stepdata_ptr first = reader->GetDataForStep(steps[0]);
+  int dim[3];
+  double origin[3], spacing[3], bounds[6];
+  for (int j = 0; j < 3; j++) {
+    dim[j] = first->sp->GetDimensions()[j];
+    origin[j] = first->sp->GetOrigin()[j];
+    spacing[j] = first->sp->GetSpacing()[j];
+  }
+  GetGridBounds(*first, bounds);
+  RayCaster caster(winsize[0], winsize[1], bgcolor, nthreads);
+  if (camplaced) {
+    caster.SetCamera(camposition, camfocus, campitch, camroll, camazimuth);
+  } else {
+    caster.ResetCamera(bounds);
+    caster.Turn(campitch, camroll, camazimuth);
+  }
+  // the static types are drawn once and the animated types of each step are drawn over them. Only the voxels
+  // under the animated types are kept aside and put back after the step, so the grid is held only once.
+  const vtkIdType lo[3] = {0, 0, 0};
+  size_t n = (size_t) dim[0] * dim[1] * dim[2];
+  std::vector<unsigned char> rgba(4 * n, 0);
+  FillRGBA(*first, GetVoxelsForTypes(*first, static_tau), colors, opacity, color_by, cms, lo, dim, rgba.data());
+  first.reset();
+  int threads = GetNumberOfThreads(nthreads);
+  for (auto step : steps) {
+    stepdata_ptr data = reader->GetDataForStep(step);
+    int *d = data->sp->GetDimensions();
+    if (d[0] != dim[0] || d[1] != dim[1] || d[2] != dim[2]) {
+      std::cout << "Dimensions of step " << step << " differ from those of step " << steps[0] << std::endl;
+      exit(0);
+    }
+    std::vector<std::vector<vtkIdType> > voxels = GetVoxelsForTypes(*data, taulist);
+    std::vector<std::vector<unsigned char> > covered(voxels.size());
+    for (size_t i = 0; i < voxels.size(); i++) { CopyVoxels(rgba.data(), voxels[i], covered[i], false, threads); }
+    FillRGBA(*data, voxels, colors, opacity, color_by, cms, lo, dim, rgba.data());
+    for (size_t v = 0; v < std::max<size_t>(views.size(), 1); v++) {
+      if (!views.empty() && views[v].custom) {
+        caster.SetCamera(views[v].position, views[v].focus, views[v].pitch, views[v].roll, views[v].azimuth);
+      } else if (!views.empty()) {
+        caster.ResetCamera(bounds);
+        caster.Turn(views[v].pitch, views[v].roll, views[v].azimuth);
+      }
+      // every frame gets its own image, as the encoders may still be writing the previous ones
+      vtkSmartPointer<vtkImageData> image = vtkSmartPointer<vtkImageData>::New();
+      vtkSmartPointer<vtkUnsignedCharArray> pixels = vtkSmartPointer<vtkUnsignedCharArray>::New();
+      pixels->SetNumberOfComponents(3);
+      pixels->SetNumberOfTuples((vtkIdType) winsize[0] * winsize[1]);
+      image->SetDimensions(winsize[0], winsize[1], 1);
+      image->GetPointData()->SetScalars(pixels);
+      caster.Render(rgba.data(), dim, origin, spacing, pixels->GetPointer(0));
+      SaveFrame(step, image, views.empty() ? "" : views[v].name);
+    }
+    // put the static types back for the next step
+    for (size_t i = 0; i < voxels.size(); i++) { CopyVoxels(rgba.data(), voxels[i], covered[i], true, threads); }
   }
 }
 
@@ -392,7 +1651,29 @@ void Visualizer::AnimateOnScreen(std::vector<int> taulist,
                          std::vector<std::string> color_by,
                          std::vector<ColorMap *> cms,bool loop, std::map<std::string,color> planes) {
   renderWindowInteractor->Initialize();
-  VisualizeStep(steps[0], static_tau, false, colors, opacity, save, color_by, cms, planes, true);
+  VisualizeStep(steps[0], std::vector<int>(), false, colors, opacity, false, color_by, cms, planes, true, false);
+  // the static types are drawn once and saved with the first step, not on their own. With lod they get a coarse
+  // set as well, switched together with the coarse set of the animated types.
+  if (!static_tau.empty()) {
+    stepdata_ptr first = reader->GetDataForStep(steps[0]);
+    stepdata_ptr coarsefirst;
+    if (lod > 1)
+      coarsefirst = Downsample(*first, lod, GetNumberOfThreads(nthreads));
+    if (render.compare("volume") == 0) {
+      // vtk draws volumes over each other rather than mixing their samples, so they go under the animated types
+      FillBackground(full, *first, static_tau, colors, opacity, color_by, cms);
+      if (lod > 1)
+        FillBackground(coarse, *coarsefirst, static_tau, colors, opacity, color_by, cms);
+    } else {
+      FillPipelines(first, fullstatic, false, static_tau, colors, opacity, color_by, cms);
+      AttachPipelines(fullstatic);
+      if (lod > 1) {
+        FillPipelines(coarsefirst, coarsestatic, false, static_tau, colors, opacity, color_by, cms);
+        AttachPipelines(coarsestatic);
+        ShowPipelines(coarsestatic, false);
+      }
+    }
+  }
   std::vector<int> update_tau;
   vtkSmartPointer<vtkTimerCallback> cb = vtkSmartPointer<vtkTimerCallback>::New();
   cb->tmax = (int) steps.size();
@@ -409,7 +1690,16 @@ void Visualizer::AnimateOnScreen(std::vector<int> taulist,
       cb->color_by.push_back(color_by[i]);
     }
   }
+  cb->interactor = renderWindowInteractor;
   renderWindowInteractor->AddObserver(vtkCommand::TimerEvent, cb);
+  renderWindowInteractor->AddObserver(vtkCommand::KeyPressEvent, cb);
+  if (lod > 1) {
+    unsigned long buttons[6] = {vtkCommand::LeftButtonPressEvent, vtkCommand::LeftButtonReleaseEvent,
+                                vtkCommand::MiddleButtonPressEvent, vtkCommand::MiddleButtonReleaseEvent,
+                                vtkCommand::RightButtonPressEvent, vtkCommand::RightButtonReleaseEvent};
+    // observe the buttons before the interactor style acts on them
+    for (auto b : buttons) { renderWindowInteractor->AddObserver(b, cb, 1.0); }
+  }
   int timerId = renderWindowInteractor->CreateRepeatingTimer((unsigned int) (1000 / fps));
 
   renderWindowInteractor->Start();
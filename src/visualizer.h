@@ -5,12 +5,21 @@
 #ifndef VISGRID3D_VISUALIZER_H
 #define VISGRID3D_VISUALIZER_H
 
+#include <map>
 #include <vector>
 #include <utility>
 #include <vtkActor.h>
 #include <vtkSmartPointer.h>
 #include <vtkPoints.h>
+#include <vtkPolyData.h>
+#include <vtkCubeSource.h>
+#include <vtkGlyph3D.h>
+#include <vtkPolyDataMapper.h>
+#include <vtkImageData.h>
+#include <vtkVolume.h>
+#include <vtkProp.h>
 #include <vtkRenderer.h>
+#include <vtkCamera.h>
 #include <vtkRenderWindow.h>
 #include <vtkRenderWindowInteractor.h>
 #include <vtkUnsignedCharArray.h>
@@ -19,11 +28,53 @@
 #include "colortable.h"
 #include "colormap.h"
 
+class FrameWriter;
+class MovieWriter;
+
+
+// Long-lived pipeline drawing one type, which is handed the data of each new step
+struct typepipeline {
+  vtkSmartPointer<vtkCubeSource> cube;
+  vtkSmartPointer<vtkPoints> points;
+  vtkSmartPointer<vtkUnsignedCharArray> colors;
+  vtkSmartPointer<vtkPolyData> polydata;
+  vtkSmartPointer<vtkGlyph3D> glyph;
+  vtkSmartPointer<vtkPolyDataMapper> mapper;
+  vtkSmartPointer<vtkActor> actor;
+};
+
+// Pipelines of the animated types in the order they are listed, with one per brick when bricks are used
+struct pipelineset {
+  pipelineset() : backlo{0, 0, 0}, backsize{0, 0, 0}, step(-1) {}
+  std::vector<std::vector<typepipeline> > pipelines;
+  // or a single volume with the colors and opacities of all types
+  vtkSmartPointer<vtkImageData> image;
+  vtkSmartPointer<vtkUnsignedCharArray> rgba;
+  vtkSmartPointer<vtkVolume> volume;
+  // RGBA of the static types in the box of backsize voxels from backlo, drawn under the animated types of a volume
+  std::vector<unsigned char> background;
+  vtkIdType backlo[3];
+  int backsize[3];
+  // props to add to or remove from the renderer, which is only touched by the thread that renders
+  std::vector<vtkSmartPointer<vtkProp> > added, removed;
+  stepdata_ptr previous;  // data drawn last, to find the bricks that change with the next step
+  int step;  // step drawn last
+};
+
+// Camera of one of the views each step is rendered from
+struct cameraview {
+  std::string name;  // added to the names of the images
+  bool custom;  // the camera is placed at position and focus rather than fitted to the grid
+  double position[3];
+  double focus[3];
+  double pitch, roll, azimuth;
+};
 
 class Visualizer {
  public:
-  Visualizer(){};
+  Visualizer() : writer(NULL) {};
   Visualizer(DataReader *_reader);
+  ~Visualizer();
   void InitRenderer(bool onscreen);
   void ModifyCamera();
 
@@ -41,7 +92,8 @@ class Visualizer {
                                                           bool save,
                                                           std::vector<std::string> color_by,
                                                           std::vector<ColorMap *> cms,
-                                                          std::map<std::string,color> planes, bool bbox);
+                                                          std::map<std::string,color> planes, bool bbox,
+                                                          bool persistent);
   color bgcolor, bbcolor;
   std::vector<int> winsize;
   double fps;
@@ -51,23 +103,96 @@ class Visualizer {
   int numlen;
   std::string prefix;
   std::string impath;
+  int nthreads;  // threads used to extract geometry, 0 to use all cores
+  std::string render;  // glyph: a cube per voxel, faces: only the faces on the boundary of each type, surface: smooth
+                       // surfaces, volume: ray cast volume
+  bool greedy;  // merge neighbouring faces of the same color into larger rectangles when rendering faces
+  std::string surfaceby;  // type: a surface per type, cell: a surface per cell
+  int smooth;  // smoothing iterations for surfaces
+  double decimate;  // fraction of the triangles of surfaces to remove
+  bool cull;  // leave out voxels enclosed by voxels of the same opaque type when drawing glyphs
+  bool incremental;  // only rebuild the bricks of animated types that changed since the previous step
+  int bricksize;  // voxels along each side of the bricks the grid is drawn in, 0 to draw each type as a whole
+  int lod;  // factor the grid is downsampled by while playing or moving the camera on screen, 1 for full detail
+  bool lowres;  // draw the types at the lower level of detail
+  std::string backend;  // vtk: draw with a vtk render window, raycast: draw voxels with the built-in ray caster
+  bool camplaced;  // camposition and camfocus were both given, otherwise the camera is fitted to the grid
+  int encoders;  // threads writing images
+  std::string format;  // png, ppm or raw (rgb bytes, top row first)
+  int pnglevel;  // zlib compression level of png images, 0-9
+  std::string movie;  // movie the saved frames are streamed to with ffmpeg instead of writing images
+  std::string movietag;  // added to the name of the movie before its extension, to tell shards apart
+  std::vector<cameraview> views;  // views every step is rendered from off screen, none for just the camera above
 
  private:
   vtkSmartPointer<vtkActor>
-  GetActorForType(stepdata data, int tau, color c, double opacity, std::string color_by, ColorMap *cm);
-  vtkSmartPointer<vtkActor> GetActorForBox(stepdata data);
-  vtkSmartPointer<vtkPoints> GetPointsForTau(stepdata data, int tau);
-  std::pair<vtkSmartPointer<vtkPoints>, vtkSmartPointer<vtkUnsignedCharArray>>
-  GetPointsAndColorsForTau(stepdata data, int tau, std::string color_by, ColorMap *cm);
+  GetActorForType(const stepdata &data, const std::vector<vtkIdType> &ids, color c, double opacity,
+                  std::string color_by, ColorMap *cm);
+  typepipeline NewPipeline();
+  void UpdatePipeline(typepipeline &p, const stepdata &data, const std::vector<vtkIdType> &ids, color c,
+                      double opacity, std::string color_by, ColorMap *cm);
+  // Show or hide every actor and volume of a set
+  void ShowPipelines(pipelineset &set, bool visible);
+  void UpdateVolume(pipelineset &set, const stepdata &data, std::vector<int> taulist, std::vector<color> tau_colors,
+                    std::vector<double> tau_opacity, std::vector<std::string> color_by, std::vector<ColorMap *> cms);
+  // Draw the static types into the background of the volume of a set
+  void FillBackground(pipelineset &set, const stepdata &data, std::vector<int> static_tau,
+                      std::vector<color> tau_colors, std::vector<double> tau_opacity,
+                      std::vector<std::string> color_by, std::vector<ColorMap *> cms);
+  // Write the colors and opacities of the voxels of each type into an RGBA image of the given size starting at lo
+  void FillRGBA(const stepdata &data, const std::vector<std::vector<vtkIdType> > &voxels,
+                std::vector<color> tau_colors, std::vector<double> tau_opacity, std::vector<std::string> color_by,
+                std::vector<ColorMap *> cms, const vtkIdType *lo, const int *size, unsigned char *rgba);
+  void RayCastOffScreen(std::vector<int> taulist, std::vector<int> steps, std::vector<int> static_tau,
+                        std::vector<color> colors, std::vector<double> opacity,
+                        std::vector<std::string> color_by, std::vector<ColorMap *> cms);
+  // Fill the pipelines of a set with the animated types of a step, only where they changed with diff and bricks.
+  // The renderer is left alone, so this can run next to rendering another set.
+  void FillPipelines(stepdata_ptr dataptr, pipelineset &set, bool diff, std::vector<int> taulist,
+                     std::vector<color> tau_colors, std::vector<double> tau_opacity,
+                     std::vector<std::string> color_by, std::vector<ColorMap *> cms);
+  // Add the new props of a set to the renderer and remove the old ones
+  void AttachPipelines(pipelineset &set);
+  // Fill a pipeline per type and brick, only for the bricks that changed since the previous step with diff
+  void UpdateBricks(stepdata_ptr dataptr, pipelineset &set, bool diff,
+                    std::vector<int> taulist, std::vector<color> tau_colors, std::vector<double> tau_opacity,
+                    std::vector<std::string> color_by, std::vector<ColorMap *> cms);
+  vtkSmartPointer<vtkActor> GetActorForBox(const stepdata &data);
+  std::vector<std::vector<vtkIdType> > GetVoxelsForTypes(const stepdata &data, std::vector<int> taulist);
+  std::vector<vtkIdType> CullHiddenVoxels(const stepdata &data, const std::vector<vtkIdType> &ids);
+  void GetPointsForTau(const stepdata &data, const std::vector<vtkIdType> &ids, vtkPoints *points);
+  void GetColorsForTau(const stepdata &data, const std::vector<vtkIdType> &ids, std::string color_by, ColorMap *cm,
+                       vtkUnsignedCharArray *colors);
+  vtkSmartPointer<vtkPolyData>
+  GetFacesForType(const stepdata &data, const std::vector<vtkIdType> &ids, std::string color_by, ColorMap *cm);
+  vtkSmartPointer<vtkPolyData>
+  GetSurfaceForType(const stepdata &data, const std::vector<vtkIdType> &ids, std::string color_by, ColorMap *cm);
   vtkSmartPointer<vtkActor> GetPlane(std::vector<std::vector<int>> corners, color planecolor);
-  std::vector< vtkSmartPointer<vtkActor> > GetBoundaryPlanes(stepdata data, std::map<std::string,color> planes);
+  std::vector< vtkSmartPointer<vtkActor> > GetBoundaryPlanes(const stepdata &data, std::map<std::string,color> planes);
 
-  std::string GetImNameForStep(int step);
+  std::string GetImNameForStep(int step, std::string view = "");
+  // Point the camera of the renderer like a view, fitting it to the bounds of the grid for views without a position
+  void SetView(const cameraview &view, const double *bounds);
+  // Bounds of the voxels of the grid, which reach half a voxel beyond its points
+  void GetGridBounds(const stepdata &data, double *bounds);
+  // Pool writing the saved images, started with the first one
+  FrameWriter *GetFrameWriter();
+  // Write a frame to an image for the step or add it to the movie
+  void SaveFrame(int step, vtkSmartPointer<vtkImageData> image, std::string view = "");
+  // Copy of the current contents of the render window
+  vtkSmartPointer<vtkImageData> GrabWindow();
 
   vtkSmartPointer<vtkRenderer> renderer;
   vtkSmartPointer<vtkRenderWindow> renderWindow;
   vtkSmartPointer<vtkRenderWindowInteractor> renderWindowInteractor;
   DataReader *reader;
+  pipelineset full;  // animated types at full detail
+  pipelineset coarse;  // animated types at the lower level of detail
+  pipelineset fullstatic;  // static types at full detail
+  pipelineset coarsestatic;  // static types at the lower level of detail
+  FrameWriter *writer;
+  std::map<std::string, MovieWriter *> moviewriters;  // a movie per view
+  vtkSmartPointer<vtkCamera> defaultcamera;  // camera of the renderer before ModifyCamera
 };
 
 #endif //VISGRID3D_VISUALIZER_H